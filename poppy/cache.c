@@ -0,0 +1,489 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <threads.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "poppy.h"
+#include "track.h"
+#include "cache.h"
+#include "xdg.h"
+
+// The index is a header followed by one record per file, each
+// laid out so that it can be used straight out of the mapping.
+
+#define CACHE_MAGIC   "poppyidx"
+#define CACHE_VERSION 2
+
+typedef struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t files;
+} cache_header;
+
+// What a file looked like when it was probed.
+typedef struct cache_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} cache_key;
+
+enum {
+	TAG_ARTIST,
+	TAG_ALBUM,
+	TAG_TITLE,
+	TAG_TRACKNUMBER,
+	TAG_TRACKTOTAL,
+	TAGS,
+};
+
+typedef struct cache_desc {
+	int64_t link_start;
+	int64_t link_end;
+	uint32_t codec;
+	uint32_t isogg;
+	uint32_t has_meta;
+	int32_t channels;
+	int32_t bit_depth;
+	// Not the rate decoded to, which depends on -n.
+	int32_t sample_rate;
+	int32_t bit_rate;
+	float length;
+	// Offset into the file's strings plus one, or zero for none.
+	uint32_t tag[TAGS];
+} cache_desc;
+
+// Followed by its descs, then its strings, starting with its path,
+// then zeros up to the next multiple of 8 bytes.
+typedef struct cache_file {
+	uint32_t size;
+	uint32_t descs;
+	cache_key key;
+} cache_file;
+
+typedef struct entry {
+	char *path;
+	// Where path was last indexed, for the index table.
+	const cache_file *file;
+	// Where path leads now, for the seen table.
+	char *real;
+	cache_key key;
+} entry;
+
+// Open addressing on path, never shrinks.
+typedef struct table {
+	entry *slot;
+	size_t cap;
+	size_t cnt;
+} table;
+
+static struct {
+	const unsigned char *map;
+	size_t map_size;
+	// Real paths of indexed files.
+	table index;
+	// Files probed this run, as named on the command line.
+	table seen;
+	// Tracks and metadata counted at the last save.
+	long saved;
+	mtx_t lock;
+} cache;
+
+static size_t hash(const char *s) {
+	size_t h = 14695981039346656037u;
+	for (; *s; s++) h = (h ^ (unsigned char) *s) * 1099511628211u;
+	return h;
+}
+
+static entry *table_find(table *t, const char *path) {
+	if (!t->cap) return NULL;
+	for (size_t i = hash(path) & (t->cap-1);; i = (i+1) & (t->cap-1)) {
+		if (!t->slot[i].path) return &t->slot[i];
+		if (!strcmp(t->slot[i].path, path)) return &t->slot[i];
+	}
+}
+
+static entry *table_get(table *t, const char *path) {
+	entry *e = table_find(t, path);
+	return e && e->path ? e : NULL;
+}
+
+static entry *table_put(table *t, const char *path) {
+	if (2*(t->cnt+1) > t->cap) {
+		table grown = { .cap = t->cap ? 2*t->cap : 64, .cnt = t->cnt };
+		grown.slot = calloc(grown.cap, sizeof *grown.slot);
+		if (!grown.slot) return NULL;
+		for (size_t i = 0; i < t->cap; i++) {
+			if (t->slot[i].path) {
+				*table_find(&grown, t->slot[i].path) = t->slot[i];
+			}
+		}
+		free(t->slot);
+		*t = grown;
+	}
+	entry *e = table_find(t, path);
+	if (!e->path) {
+		if (!(e->path = strdup(path))) return NULL;
+		t->cnt++;
+	}
+	return e;
+}
+
+static const cache_desc *file_descs(const cache_file *file) {
+	return (const cache_desc*) (file + 1);
+}
+
+static const char *file_strings(const cache_file *file) {
+	return (const char*) (file_descs(file) + file->descs);
+}
+
+static const char *file_string(const cache_file *file, uint32_t tag) {
+	return tag ? file_strings(file) + tag - 1 : NULL;
+}
+
+// Checks that the record at the offset stays inside the mapping.
+static const cache_file *file_at(size_t at) {
+	if (at + sizeof(cache_file) > cache.map_size) return NULL;
+	const cache_file *file = (const cache_file*) &cache.map[at];
+	size_t fixed = sizeof *file + file->descs * sizeof(cache_desc);
+	if (file->size % 8 || file->size <= fixed ||
+		file->descs > file->size / sizeof(cache_desc) ||
+		at + file->size > cache.map_size) {
+		return NULL;
+	}
+	// Strings may not run past the end of their record.
+	size_t strings = file->size - fixed;
+	if (file_strings(file)[strings-1]) return NULL;
+	const cache_desc *desc = file_descs(file);
+	for (uint32_t d = 0; d < file->descs; d++) {
+		if (desc[d].codec > FLAC) return NULL;
+		for (int t = 0; t < TAGS; t++) {
+			if (desc[d].tag[t] > strings) return NULL;
+		}
+	}
+	return file;
+}
+
+// Where the index lives, with its directory made if create.
+static int cache_path(char *path, size_t len, bool create) {
+	char dir[4096] = {0};
+	xdg_cache_home(dir);
+	strcat(dir, "/poppy");
+	if (create) {
+		int r = mkdirp(dir, 0700);
+		if (r && errno != EEXIST) {
+			fprintf(stderr, "mkdir %s: ", dir);
+			perror("");
+			return -1;
+		}
+	}
+	if ((size_t) snprintf(path, len, "%s/index", dir) >= len) return -1;
+	return 0;
+}
+
+static cache_key key_of(const struct stat *st) {
+	return (cache_key) {
+		.dev        = st->st_dev,
+		.ino        = st->st_ino,
+		.size       = st->st_size,
+		.mtime_sec  = st->st_mtim.tv_sec,
+		.mtime_nsec = st->st_mtim.tv_nsec,
+	};
+}
+
+void cache_load(void) {
+	mtx_init(&cache.lock, mtx_plain);
+	char path[4096];
+	if (cache_path(path, sizeof path, false) < 0) return;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(cache_header)) {
+		close(fd);
+		return;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return;
+	const cache_header *header = map;
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof header->magic) ||
+		header->version != CACHE_VERSION) {
+		munmap(map, st.st_size);
+		return;
+	}
+	// Saves replace the file rather than write over it,
+	// so the mapping stays good for the rest of the run.
+	cache.map = map;
+	cache.map_size = st.st_size;
+	size_t at = sizeof *header;
+	for (uint32_t f = 0; f < header->files; f++) {
+		const cache_file *file = file_at(at);
+		if (!file) {
+			fprintf(stderr, "ignoring damaged cache: %s\n", path);
+			break;
+		}
+		entry *e = table_put(&cache.index, file_strings(file));
+		if (e) e->file = file;
+		at += file->size;
+	}
+}
+
+int cache_lookup(const char *filename, track_desc **descs) {
+	char *real = realpath(filename, NULL);
+	struct stat st;
+	if (!real || stat(real, &st) < 0) {
+		free(real);
+		return -1;
+	}
+	cache_key key = key_of(&st);
+	mtx_lock(&cache.lock);
+	entry *seen = table_put(&cache.seen, filename);
+	if (seen) {
+		free(seen->real);
+		seen->real = real;
+		seen->key  = key;
+	}
+	entry *indexed = table_get(&cache.index, real);
+	const cache_file *file = indexed ? indexed->file : NULL;
+	if (!seen) free(real);
+	mtx_unlock(&cache.lock);
+	if (!file || memcmp(&file->key, &key, sizeof key)) return -1;
+
+	*descs = calloc(file->descs ? file->descs : 1, sizeof **descs);
+	const char *name = strdup(filename);
+	if (!*descs || !name) {
+		free(*descs);
+		free((char*) name);
+		return -1;
+	}
+	const cache_desc *desc = file_descs(file);
+	for (uint32_t d = 0; d < file->descs; d++) {
+		track_desc *out = &(*descs)[d];
+		*out = (track_desc) {
+			.filename   = name,
+			.codec      = desc[d].codec,
+			.isogg      = desc[d].isogg,
+			.link_start = desc[d].link_start,
+			.link_end   = desc[d].link_end,
+		};
+		if (!desc[d].has_meta) continue;
+		// Tags are used straight out of the mapping.
+		out->meta = (track_meta) {
+			.codec       = desc[d].codec,
+			.channels    = desc[d].channels,
+			.bit_depth   = desc[d].bit_depth,
+			.sample_rate = desc[d].sample_rate,
+			.dec_rate    = output_rate(desc[d].sample_rate),
+			.length      = desc[d].length,
+			.bit_rate    = desc[d].bit_rate,
+			.artist      = file_string(file, desc[d].tag[TAG_ARTIST]),
+			.album       = file_string(file, desc[d].tag[TAG_ALBUM]),
+			.title       = file_string(file, desc[d].tag[TAG_TITLE]),
+			.tracknumber = file_string(file, desc[d].tag[TAG_TRACKNUMBER]),
+			.tracktotal  = file_string(file, desc[d].tag[TAG_TRACKTOTAL]),
+		};
+		atomic_init(&out->has_meta, true);
+	}
+	return file->descs;
+}
+
+typedef struct buf {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+} buf;
+
+// Appends n zeros, returning their offset or -1.
+static long buf_grow(buf *b, size_t n) {
+	if (b->len + n > b->cap) {
+		size_t cap = b->cap ? b->cap : 0x1000;
+		while (cap < b->len + n) cap *= 2;
+		unsigned char *data = realloc(b->data, cap);
+		if (!data) return -1;
+		b->data = data;
+		b->cap  = cap;
+	}
+	long at = b->len;
+	memset(&b->data[at], 0, n);
+	b->len += n;
+	return at;
+}
+
+// Appends s to the strings that start at offset strings.
+static uint32_t buf_string(buf *b, size_t strings, const char *s, bool *ok) {
+	if (!s) return 0;
+	size_t len = strlen(s) + 1;
+	long at = buf_grow(b, len);
+	if (at < 0) {
+		*ok = false;
+		return 0;
+	}
+	memcpy(&b->data[at], s, len);
+	return at - strings + 1;
+}
+
+static bool buf_file(
+	buf *b,
+	const char *real,
+	const cache_key *key,
+	const track_desc *desc,
+	int n
+) {
+	long at = buf_grow(b, sizeof(cache_file) + n * sizeof(cache_desc));
+	if (at < 0) return false;
+	size_t strings = b->len;
+	bool ok = true;
+	buf_string(b, strings, real, &ok);
+	for (int d = 0; d < n; d++) {
+		const track_meta *meta = &desc[d].meta;
+		bool has_meta = atomic_load(&desc[d].has_meta);
+		cache_desc out = {
+			.link_start = desc[d].link_start,
+			.link_end   = desc[d].link_end,
+			.codec      = desc[d].codec,
+			.isogg      = desc[d].isogg,
+			.has_meta   = has_meta,
+		};
+		if (has_meta) {
+			out.channels    = meta->channels;
+			out.bit_depth   = meta->bit_depth;
+			out.sample_rate = meta->sample_rate;
+			out.bit_rate    = meta->bit_rate;
+			out.length      = meta->length;
+			out.tag[TAG_ARTIST]      = buf_string(b, strings, meta->artist, &ok);
+			out.tag[TAG_ALBUM]       = buf_string(b, strings, meta->album, &ok);
+			out.tag[TAG_TITLE]       = buf_string(b, strings, meta->title, &ok);
+			out.tag[TAG_TRACKNUMBER] = buf_string(b, strings, meta->tracknumber, &ok);
+			out.tag[TAG_TRACKTOTAL]  = buf_string(b, strings, meta->tracktotal, &ok);
+		}
+		if (!ok) return false;
+		// Appending strings may have moved the buffer.
+		cache_desc *descs = (cache_desc*) &b->data[at + sizeof(cache_file)];
+		descs[d] = out;
+	}
+	if (buf_grow(b, (8 - b->len % 8) % 8) < 0) return false;
+	cache_file *file = (cache_file*) &b->data[at];
+	file->size  = b->len - at;
+	file->descs = n;
+	file->key   = *key;
+	return true;
+}
+
+static bool buf_write(const buf *b) {
+	char path[4096], tmp[4096+32];
+	if (cache_path(path, sizeof path, true) < 0) return false;
+	snprintf(tmp, sizeof tmp, "%s.%ld", path, (long) getpid());
+	FILE *f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "fopen: %s: ", tmp);
+		perror("");
+		return false;
+	}
+	bool ok = fwrite(b->data, 1, b->len, f) == b->len;
+	ok = !fclose(f) && ok;
+	if (!ok || rename(tmp, path)) {
+		fprintf(stderr, "unable to write cache: %s\n", path);
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+void cache_save(struct player *player) {
+	struct playlist *pl = &player->pl;
+	mtx_lock(&cache.lock);
+	mtx_lock(&pl->lock);
+	int size = pl->size;
+	track_desc *desc = malloc((size ? size : 1) * sizeof *desc);
+	long known = size;
+	for (int i = 0; desc && i < size; i++) {
+		bool has_meta = atomic_load_explicit(
+			&pl->desc[i].has_meta, memory_order_acquire);
+		desc[i] = (track_desc) {
+			.filename   = pl->desc[i].filename,
+			.codec      = pl->desc[i].codec,
+			.isogg      = pl->desc[i].isogg,
+			.link_start = pl->desc[i].link_start,
+			.link_end   = pl->desc[i].link_end,
+		};
+		if (has_meta) desc[i].meta = pl->desc[i].meta;
+		atomic_init(&desc[i].has_meta, has_meta);
+		known += has_meta;
+	}
+	mtx_unlock(&pl->lock);
+	if (!desc || known == cache.saved) goto done;
+
+	buf b = { 0 };
+	table written = { 0 };
+	uint32_t files = 0;
+	if (buf_grow(&b, sizeof(cache_header)) < 0) goto done;
+	for (int i = 0, n; i < size; i += n) {
+		// A file's tracks sit next to each other on the playlist,
+		// its links in order, so a file given twice over starts again.
+		for (n = 1; i+n < size; n++) {
+			if (strcmp(desc[i].filename, desc[i+n].filename)) break;
+			if (desc[i+n].link_start <= desc[i+n-1].link_start) break;
+		}
+		entry *seen = table_get(&cache.seen, desc[i].filename);
+		if (!seen || !seen->real || table_get(&written, seen->real)) continue;
+		// Leave out files that changed while playing.
+		struct stat st;
+		if (stat(seen->real, &st) < 0) continue;
+		cache_key key = key_of(&st);
+		if (memcmp(&key, &seen->key, sizeof key)) continue;
+		if (!buf_file(&b, seen->real, &key, &desc[i], n)) goto fail;
+		table_put(&written, seen->real);
+		files++;
+	}
+	// Keep what earlier runs knew about files not played this time.
+	for (size_t s = 0; s < cache.index.cap; s++) {
+		const entry *e = &cache.index.slot[s];
+		if (!e->path || table_get(&written, e->path)) continue;
+		long at = buf_grow(&b, e->file->size);
+		if (at < 0) goto fail;
+		memcpy(&b.data[at], e->file, e->file->size);
+		files++;
+	}
+	cache_header *header = (cache_header*) b.data;
+	memcpy(header->magic, CACHE_MAGIC, sizeof header->magic);
+	header->version = CACHE_VERSION;
+	header->files   = files;
+	if (buf_write(&b)) cache.saved = known;
+fail:
+	for (size_t s = 0; s < written.cap; s++) free(written.slot[s].path);
+	free(written.slot);
+	free(b.data);
+done:
+	free(desc);
+	mtx_unlock(&cache.lock);
+}
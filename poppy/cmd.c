@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "cmd.h"
+
+void cmd_push(cmd_queue *queue, cmd *cmd) {
+	struct cmd *head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	do {
+		cmd->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&queue->head, &head, cmd,
+		memory_order_release, memory_order_relaxed));
+}
+
+// The consumer takes the whole stack at once, so pushes never
+// race a pop and there is no ABA to worry about.
+cmd *cmd_take(cmd_queue *queue) {
+	cmd *head = atomic_exchange_explicit(&queue->head, NULL,
+		memory_order_acquire);
+	cmd *oldest = NULL;
+	while (head) {
+		cmd *next = head->next;
+		head->next = oldest;
+		oldest = head;
+		head = next;
+	}
+	return oldest;
+}
@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONV_X86
+#include <immintrin.h>
+#endif
+
+#include "conv.h"
+
+#define CONV_MAX_CHANNELS 8
+
+typedef void conv_fn(
+	float *out,
+	const int32_t *const *src,
+	int channels,
+	int frames,
+	float scale
+);
+
+// src is indexed by output position, so the kernels never see order.
+static void conv_scalar(
+	float *out,
+	const int32_t *const *src,
+	int channels,
+	int frames,
+	float scale
+) {
+	for (int o = 0; o < channels; o++) {
+		const int32_t *x = src[o];
+		float *y = &out[o];
+		for (int f = 0; f < frames; f++) y[channels*f] = x[f] * scale;
+	}
+}
+
+#ifdef CONV_X86
+__attribute__((target("sse2")))
+static void conv_sse2(
+	float *out,
+	const int32_t *const *src,
+	int channels,
+	int frames,
+	float scale
+) {
+	const __m128 k = _mm_set1_ps(scale);
+	int f = 0;
+	for (; f+4 <= frames; f += 4) {
+		__m128 v[CONV_MAX_CHANNELS];
+		for (int o = 0; o < channels; o++) {
+			__m128i x = _mm_loadu_si128((const __m128i*) &src[o][f]);
+			v[o] = _mm_mul_ps(_mm_cvtepi32_ps(x), k);
+		}
+		float *y = &out[channels*f];
+		switch (channels) {
+		case 1:
+			_mm_storeu_ps(y, v[0]);
+			continue;
+		case 2:
+			_mm_storeu_ps(&y[0], _mm_unpacklo_ps(v[0], v[1]));
+			_mm_storeu_ps(&y[4], _mm_unpackhi_ps(v[0], v[1]));
+			continue;
+		}
+		int o = 0;
+		for (; o+4 <= channels; o += 4) {
+			__m128 a = v[o], b = v[o+1], c = v[o+2], d = v[o+3];
+			_MM_TRANSPOSE4_PS(a, b, c, d);
+			_mm_storeu_ps(&y[o], a);
+			_mm_storeu_ps(&y[o+channels], b);
+			_mm_storeu_ps(&y[o+2*channels], c);
+			_mm_storeu_ps(&y[o+3*channels], d);
+		}
+		for (; o < channels; o++) {
+			_Alignas(16) float t[4];
+			_mm_store_ps(t, v[o]);
+			for (int i = 0; i < 4; i++) y[o+i*channels] = t[i];
+		}
+	}
+	for (int o = 0; o < channels; o++) {
+		for (int g = f; g < frames; g++) {
+			out[channels*g+o] = src[o][g] * scale;
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void conv_avx2(
+	float *out,
+	const int32_t *const *src,
+	int channels,
+	int frames,
+	float scale
+) {
+	const __m256 k = _mm256_set1_ps(scale);
+	int f = 0;
+	for (; f+8 <= frames; f += 8) {
+		__m256 v[CONV_MAX_CHANNELS];
+		for (int o = 0; o < channels; o++) {
+			__m256i x = _mm256_loadu_si256((const __m256i*) &src[o][f]);
+			v[o] = _mm256_mul_ps(_mm256_cvtepi32_ps(x), k);
+		}
+		float *y = &out[channels*f];
+		switch (channels) {
+		case 1:
+			_mm256_storeu_ps(y, v[0]);
+			continue;
+		case 2: {
+			__m256 lo = _mm256_unpacklo_ps(v[0], v[1]);
+			__m256 hi = _mm256_unpackhi_ps(v[0], v[1]);
+			_mm256_storeu_ps(&y[0], _mm256_permute2f128_ps(lo, hi, 0x20));
+			_mm256_storeu_ps(&y[8], _mm256_permute2f128_ps(lo, hi, 0x31));
+			continue;
+		}
+		}
+		int o = 0;
+		for (; o+4 <= channels; o += 4) {
+			// Frames 0-3 come from the low halves, 4-7 from the high.
+			for (int h = 0; h < 2; h++) {
+				__m128 a, b, c, d;
+				if (h == 0) {
+					a = _mm256_castps256_ps128(v[o]);
+					b = _mm256_castps256_ps128(v[o+1]);
+					c = _mm256_castps256_ps128(v[o+2]);
+					d = _mm256_castps256_ps128(v[o+3]);
+				} else {
+					a = _mm256_extractf128_ps(v[o], 1);
+					b = _mm256_extractf128_ps(v[o+1], 1);
+					c = _mm256_extractf128_ps(v[o+2], 1);
+					d = _mm256_extractf128_ps(v[o+3], 1);
+				}
+				_MM_TRANSPOSE4_PS(a, b, c, d);
+				float *z = &y[4*h*channels + o];
+				_mm_storeu_ps(z, a);
+				_mm_storeu_ps(&z[channels], b);
+				_mm_storeu_ps(&z[2*channels], c);
+				_mm_storeu_ps(&z[3*channels], d);
+			}
+		}
+		for (; o < channels; o++) {
+			_Alignas(32) float t[8];
+			_mm256_store_ps(t, v[o]);
+			for (int i = 0; i < 8; i++) y[o+i*channels] = t[i];
+		}
+	}
+	for (int o = 0; o < channels; o++) {
+		for (int g = f; g < frames; g++) {
+			out[channels*g+o] = src[o][g] * scale;
+		}
+	}
+}
+#endif
+
+static conv_fn *pick(void) {
+#ifdef CONV_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return conv_avx2;
+	if (__builtin_cpu_supports("sse2")) return conv_sse2;
+#endif
+	return conv_scalar;
+}
+
+void conv_s32_planar(
+	float *out,
+	const int32_t *const *in,
+	const int *order,
+	int channels,
+	int frames,
+	int bits
+) {
+	// Decoder threads may race to set this, but always to the same value.
+	static conv_fn *_Atomic kernel;
+	conv_fn *fn = kernel;
+	if (!fn) kernel = fn = pick();
+	float scale = ldexpf(1, 1-bits);
+	if (channels > CONV_MAX_CHANNELS) {
+		for (int ch = 0; ch < channels; ch++) {
+			float *y = &out[order[ch]];
+			for (int f = 0; f < frames; f++) y[channels*f] = in[ch][f] * scale;
+		}
+		return;
+	}
+	const int32_t *src[CONV_MAX_CHANNELS];
+	for (int ch = 0; ch < channels; ch++) src[order[ch]] = in[ch];
+	fn(out, src, channels, frames, scale);
+}
+
+void conv_f32_planar(
+	float *out,
+	const float *const *in,
+	int channels,
+	int frames
+) {
+	int f = 0;
+#if defined(__SSE__)
+	if (channels == 2) {
+		for (; f+4 <= frames; f += 4) {
+			__m128 l = _mm_loadu_ps(&in[0][f]);
+			__m128 r = _mm_loadu_ps(&in[1][f]);
+			_mm_storeu_ps(&out[2*f], _mm_unpacklo_ps(l, r));
+			_mm_storeu_ps(&out[2*f+4], _mm_unpackhi_ps(l, r));
+		}
+	} else if (channels >= 4) {
+		for (; f+4 <= frames; f += 4) {
+			float *y = &out[channels*f];
+			int o = 0;
+			for (; o+4 <= channels; o += 4) {
+				__m128 a = _mm_loadu_ps(&in[o][f]);
+				__m128 b = _mm_loadu_ps(&in[o+1][f]);
+				__m128 c = _mm_loadu_ps(&in[o+2][f]);
+				__m128 d = _mm_loadu_ps(&in[o+3][f]);
+				_MM_TRANSPOSE4_PS(a, b, c, d);
+				_mm_storeu_ps(&y[o], a);
+				_mm_storeu_ps(&y[o+channels], b);
+				_mm_storeu_ps(&y[o+2*channels], c);
+				_mm_storeu_ps(&y[o+3*channels], d);
+			}
+			for (; o < channels; o++) {
+				for (int i = 0; i < 4; i++) y[o+i*channels] = in[o][f+i];
+			}
+		}
+	}
+#endif
+	for (; f < frames; f++) {
+		for (int o = 0; o < channels; o++) out[channels*f+o] = in[o][f];
+	}
+}
@@ -0,0 +1,450 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <threads.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <pulse/pulseaudio.h>
+
+#include "poppy.h"
+#include "dbus.h"
+#include "xdg.h"
+#include "ctl.h"
+
+// Longest request line.
+#define CTL_LINE 256
+// Replies held for a client that is not reading before it is
+// read from again.
+#define CTL_OUT_MAX (64 << 10)
+
+typedef struct client {
+	int fd;
+	pa_io_event *io;
+	struct player *player;
+	pa_mainloop_api *api;
+	char in[CTL_LINE];
+	size_t in_len;
+	char *out;
+	size_t out_len;
+	size_t out_cap;
+	// Commands posted and not yet carried out.
+	int pending;
+	bool eof;
+	// Gone, but what it sent is still run, with replies dropped.
+	bool dead;
+} client;
+
+static int listen_fd = -1;
+static pa_io_event *listen_io;
+static char socket_path[sizeof ((struct sockaddr_un*) 0)->sun_path];
+
+static bool serve(client *c);
+
+static const char *const play_modes[] = {
+	[playlist]   = "playlist",
+	[repeat]     = "repeat",
+	[repeat_one] = "repeatone",
+	[single]     = "single",
+};
+
+static const char *const gain_types[] = {
+	[header_gain]   = "header",
+	[album_gain]    = "album",
+	[track_gain]    = "track",
+	[absolute_gain] = "absolute",
+};
+
+static int find_name(const char *const *names, int n, const char *name) {
+	for (int i = 0; i < n; i++) {
+		if (!strcmp(names[i], name)) return i;
+	}
+	return -1;
+}
+
+static void reply(client *c, const char *fmt, ...) {
+	if (c->dead) return;
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0) return;
+	if (c->out_len + n+2 > c->out_cap) {
+		size_t cap = c->out_cap ? c->out_cap : 1024;
+		while (c->out_len + n+2 > cap) cap *= 2;
+		char *out = realloc(c->out, cap);
+		if (!out) return;
+		c->out = out;
+		c->out_cap = cap;
+	}
+	va_start(ap, fmt);
+	vsnprintf(c->out + c->out_len, n+1, fmt, ap);
+	va_end(ap);
+	c->out_len += n;
+	c->out[c->out_len++] = '\n';
+}
+
+static void client_free(client *c) {
+	free(c->out);
+	free(c);
+}
+
+// The client is freed by flush() once it has nothing left to run.
+static void client_close(client *c) {
+	if (c->io) c->api->io_free(c->io);
+	c->io = NULL;
+	close(c->fd);
+	c->fd = -1;
+	c->eof = true;
+	c->dead = true;
+	c->out_len = 0;
+}
+
+static void cmd_ack(struct player *player, cmd *cmd) {
+	client *c = cmd->userdata;
+	c->pending--;
+	reply(c, "ok %d %.6f", cmd->done_track, cmd->done_time);
+	// Anything waiting on this command may go now.
+	serve(c);
+}
+
+static void post(client *c, cmd proto) {
+	cmd *cmd = malloc(sizeof *cmd);
+	if (!cmd) {
+		reply(c, "err out of memory");
+		return;
+	}
+	*cmd = proto;
+	cmd->ack = cmd_ack;
+	cmd->userdata = c;
+	c->pending++;
+	player_command(c->player, cmd);
+}
+
+static void cork(client *c, bool cork) {
+	struct player *player = c->player;
+	player_cork(player, cork);
+	if (player->conn) signal_playback_status(player->conn, player);
+	reply(c, "ok");
+}
+
+static bool parse_double(const char *arg, double *x) {
+	if (!arg) return false;
+	char *end;
+	*x = strtod(arg, &end);
+	return end != arg && !*end;
+}
+
+// Commands that go to the decode thread are replied to once they have
+// been carried out. Everything else waits for those before it, so that
+// replies come in order and status reflects what came before it.
+static bool is_posted(const char *name) {
+	return
+		!strcmp(name, "next") ||
+		!strcmp(name, "prev") || !strcmp(name, "previous") ||
+		!strcmp(name, "stop") ||
+		!strcmp(name, "seek") ||
+		!strcmp(name, "pos")  || !strcmp(name, "position");
+}
+
+static void run(client *c, char *name, char *arg) {
+	struct player *player = c->player;
+	double x;
+	if (!strcmp(name, "next")) {
+		post(c, (cmd) { .type = CMD_NEXT });
+	}
+	else if (!strcmp(name, "prev") || !strcmp(name, "previous")) {
+		post(c, (cmd) { .type = CMD_PREVIOUS });
+	}
+	else if (!strcmp(name, "stop")) {
+		post(c, (cmd) { .type = CMD_STOP });
+	}
+	else if (!strcmp(name, "seek")) {
+		if (!parse_double(arg, &x)) {
+			reply(c, "err seek <seconds>");
+			return;
+		}
+		post(c, (cmd) { .type = CMD_SEEK, .time = x });
+	}
+	else if (!strcmp(name, "pos") || !strcmp(name, "position")) {
+		if (!parse_double(arg, &x) || x < 0) {
+			reply(c, "err position <seconds>");
+			return;
+		}
+		post(c, (cmd) {
+			.type  = CMD_SET_POSITION,
+			.track = player_now(player).track,
+			.time  = x,
+		});
+	}
+	else if (!strcmp(name, "play"))  cork(c, false);
+	else if (!strcmp(name, "pause")) cork(c, true);
+	else if (!strcmp(name, "toggle")) {
+		cork(c, player_snapshot(player).playing);
+	}
+	else if (!strcmp(name, "status")) {
+		player_update_position(player);
+		now_playing now = player_snapshot(player);
+		const char *status = player_playback_status(player);
+		reply(c, "ok %s %d %.6f %.6f",
+			status,
+			now.mark.track,
+			now.position,
+			now.has_meta ? now.meta.length : 0.0
+		);
+	}
+	else if (!strcmp(name, "volume")) {
+		if (!arg) {
+			reply(c, "ok %.6f", player->volume);
+			return;
+		}
+		if (!parse_double(arg, &x) || x < 0) {
+			reply(c, "err volume [<linear>]");
+			return;
+		}
+		mtx_lock(&player->lock);
+		player_set_volume(player, x);
+		mtx_unlock(&player->lock);
+		if (player->conn) signal_volume(player->conn, player);
+		reply(c, "ok %.6f", player->volume);
+	}
+	else if (!strcmp(name, "playmode")) {
+		int n = sizeof play_modes / sizeof *play_modes;
+		int mode = arg ? find_name(play_modes, n, arg) : player->play_mode;
+		if (mode < 0) {
+			reply(c, "err playmode [playlist|repeat|repeatone|single]");
+			return;
+		}
+		mtx_lock(&player->lock);
+		player->play_mode = mode;
+		mtx_unlock(&player->lock);
+		if (arg && player->conn) signal_loop_status(player->conn, player);
+		reply(c, "ok %s", play_modes[mode]);
+	}
+	else if (!strcmp(name, "gaintype")) {
+		int n = sizeof gain_types / sizeof *gain_types;
+		int type = arg ? find_name(gain_types, n, arg) : player->gain_type;
+		if (type < 0) {
+			reply(c, "err gaintype [header|album|track|absolute]");
+			return;
+		}
+		mtx_lock(&player->lock);
+		player->gain_type = type;
+		mtx_unlock(&player->lock);
+		reply(c, "ok %s", gain_types[type]);
+	}
+	else reply(c, "err unknown command: %s", name);
+}
+
+// Returns false if the client was closed.
+static bool flush(client *c) {
+	if (c->dead) {
+		// serve() stops short of the end of its input only
+		// to wait on a command.
+		if (!c->pending) client_free(c);
+		return false;
+	}
+	size_t done = 0;
+	while (done < c->out_len) {
+		ssize_t n = send(c->fd, c->out + done, c->out_len - done,
+			MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && errno == EAGAIN) break;
+		if (n < 0) {
+			client_close(c);
+			serve(c);
+			return false;
+		}
+		done += n;
+	}
+	if (done) {
+		memmove(c->out, c->out + done, c->out_len - done);
+		c->out_len -= done;
+	}
+	if (c->eof && !c->in_len && !c->pending && !c->out_len) {
+		client_close(c);
+		client_free(c);
+		return false;
+	}
+	pa_io_event_flags_t events = PA_IO_EVENT_NULL;
+	if (!c->eof && c->in_len < sizeof c->in && c->out_len < CTL_OUT_MAX) {
+		events |= PA_IO_EVENT_INPUT;
+	}
+	if (c->out_len) events |= PA_IO_EVENT_OUTPUT;
+	c->api->io_enable(c->io, events);
+	return true;
+}
+
+// Runs every whole line read, up to the first that has to wait,
+// then sends whatever replies are ready.
+static bool serve(client *c) {
+	size_t at = 0;
+	while (c->out_len < CTL_OUT_MAX) {
+		char *line = c->in + at;
+		size_t left = c->in_len - at;
+		char *nl = memchr(line, '\n', left);
+		// At the end, a last line need not be terminated.
+		if (!nl && !(c->eof && left)) break;
+		size_t len = nl ? (size_t) (nl - line) : left;
+		char buf[CTL_LINE+1];
+		memcpy(buf, line, len);
+		buf[len] = '\0';
+		char *save;
+		char *name = strtok_r(buf, " \t\r", &save);
+		char *arg  = strtok_r(NULL, " \t\r", &save);
+		if (name && !is_posted(name) && c->pending) break;
+		at += nl ? len+1 : len;
+		if (name) run(c, name, arg);
+	}
+	memmove(c->in, c->in + at, c->in_len - at);
+	c->in_len -= at;
+	return flush(c);
+}
+
+static void client_cb(
+	pa_mainloop_api *api,
+	pa_io_event *event,
+	int fd,
+	pa_io_event_flags_t events,
+	void *userdata
+) {
+	client *c = userdata;
+	if (events & PA_IO_EVENT_INPUT) {
+		while (!c->eof && c->in_len < sizeof c->in) {
+			ssize_t n = read(fd, c->in + c->in_len,
+				sizeof c->in - c->in_len);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && errno == EAGAIN) break;
+			if (n <= 0) {
+				c->eof = true;
+				break;
+			}
+			c->in_len += n;
+		}
+		if (c->in_len == sizeof c->in &&
+			!memchr(c->in, '\n', c->in_len)) {
+			reply(c, "err line too long");
+			c->in_len = 0;
+			c->eof = true;
+		}
+	}
+	// Whatever was sent before the peer went away is still carried out.
+	bool hangup = events & (PA_IO_EVENT_HANGUP | PA_IO_EVENT_ERROR);
+	if (hangup) c->eof = true;
+	if (serve(c) && hangup) {
+		client_close(c);
+		serve(c);
+	}
+}
+
+static void listen_cb(
+	pa_mainloop_api *api,
+	pa_io_event *event,
+	int fd,
+	pa_io_event_flags_t events,
+	void *userdata
+) {
+	for (;;) {
+		int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cfd < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN) perror("accept");
+			return;
+		}
+		client *c = calloc(1, sizeof *c);
+		if (!c) {
+			close(cfd);
+			continue;
+		}
+		c->fd = cfd;
+		c->player = userdata;
+		c->api = api;
+		c->io = api->io_new(api, cfd, PA_IO_EVENT_INPUT, client_cb, c);
+		if (!c->io) {
+			close(cfd);
+			free(c);
+		}
+	}
+}
+
+// A socket left behind by a poppy that is gone is taken over,
+// one that is still answered is not.
+static int bind_socket(int fd, const struct sockaddr_un *addr) {
+	if (bind(fd, (const struct sockaddr*) addr, sizeof *addr) == 0) return 0;
+	if (errno != EADDRINUSE) return -1;
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe < 0) return -1;
+	int r = connect(probe, (const struct sockaddr*) addr, sizeof *addr);
+	close(probe);
+	if (r == 0 || errno != ECONNREFUSED) {
+		errno = EADDRINUSE;
+		return -1;
+	}
+	unlink(addr->sun_path);
+	return bind(fd, (const struct sockaddr*) addr, sizeof *addr);
+}
+
+int ctl_attach(struct player *player, pa_mainloop_api *api) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (ctl_socket_path(addr.sun_path, sizeof addr.sun_path, true) < 0) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (bind_socket(fd, &addr) < 0) {
+		fprintf(stderr, "bind %s: ", addr.sun_path);
+		perror("");
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, 16) < 0) {
+		perror("listen");
+		goto unlink;
+	}
+	listen_io = api->io_new(api, fd, PA_IO_EVENT_INPUT, listen_cb, player);
+	if (!listen_io) goto unlink;
+	listen_fd = fd;
+	strcpy(socket_path, addr.sun_path);
+	return 0;
+unlink:
+	unlink(addr.sun_path);
+	close(fd);
+	return -1;
+}
+
+void ctl_detach(pa_mainloop_api *api) {
+	if (listen_fd < 0) return;
+	api->io_free(listen_io);
+	close(listen_fd);
+	unlink(socket_path);
+	listen_fd = -1;
+}
@@ -399,12 +399,10 @@ void signal_seeked(
 }
 
 const char *player_playback_status(struct player *player) {
-	struct playlist *pl = &player->pl;
-	track_i *track = pl->track[pl->curr];
-	track_state state = track->state(track);
+	now_playing now = player_snapshot(player);
 	return
-		(!pa_stream_is_corked(player->stream)) ? PlaybackPlaying
-		: (pl->curr == 0 && state.time == 0) ? PlaybackStopped
+		now.playing ? PlaybackPlaying
+		: (now.mark.track == 0 && now.position == 0) ? PlaybackStopped
 		: PlaybackPaused;
 }
 
@@ -439,7 +437,7 @@ void mp2_player_prop_get_volume(
 	DBusMessageIter *iter,
 	struct player *player
 ) {
-	double volume = pow(10, player->gain / 20);
+	double volume = player->volume;
 	dbus_message_iter_append_basic(iter,
 		DBUS_TYPE_DOUBLE, &volume);
 }
@@ -448,10 +446,8 @@ void mp2_player_prop_get_position(
 	DBusMessageIter *iter,
 	struct player *player
 ) {
-	struct playlist *pl = &player->pl;
-	track_i *track = pl->track[pl->curr];
-	track_state state = track->state(track);
-	dbus_int64_t position = state.time * 1e6;
+	player_update_position(player);
+	dbus_int64_t position = player_position(player) * 1e6;
 	dbus_message_iter_append_basic(iter,
 		DBUS_TYPE_INT64, &position);
 }
@@ -460,9 +456,8 @@ void mp2_player_prop_get_metadata(
 	DBusMessageIter *iter,
 	struct player *player
 ) {
-	struct playlist *pl = &player->pl;
-	track_i *track = pl->track[pl->curr];
-	track_meta meta = track->meta(track);
+	now_playing now = player_snapshot(player);
+	track_meta meta = now.has_meta ? now.meta : (track_meta) { 0 };
 	dbus_int64_t length = meta.length * 1e6;
 
 	DBusMessageIter dict;
@@ -470,7 +465,7 @@ void mp2_player_prop_get_metadata(
 
 	char buf[] = "/org/mpris/MediaPlayer2/track/??????";
 	snprintf(buf, sizeof buf,
-		"/org/mpris/MediaPlayer2/track/%d", pl->curr);
+		"/org/mpris/MediaPlayer2/track/%d", now.mark.track);
 	const char *obj = buf;
 	iter_dict_append_basic(&dict,
 		"mpris:trackid", DBUS_TYPE_STRING, &obj);
@@ -520,6 +515,70 @@ void signal_metadata_update(
 	);
 }
 
+// The reply waits until the decode thread has carried the command out.
+static void cmd_ack(struct player *player, cmd *cmd) {
+	DBusMessage *msg = cmd->userdata;
+	reply_nothing(player->conn, msg);
+	dbus_message_unref(msg);
+}
+
+// Whatever the batch that cmd ended, however it was posted, did.
+void signal_commanded(DBusConnection *conn, const cmd *cmd) {
+	if (cmd->stopped) {
+		signal_prop_change_one_basic(conn,
+			"org.mpris.MediaPlayer2.Player",
+			"PlaybackStatus",
+			DBUS_TYPE_STRING, &PlaybackStopped
+		);
+	}
+	if (!cmd->changed) signal_seeked(conn, cmd->done_time * 1e6);
+}
+
+void signal_playback_status(DBusConnection *conn, struct player *player) {
+	const char *status = player_playback_status(player);
+	signal_prop_change_one_basic(conn,
+		"org.mpris.MediaPlayer2.Player",
+		"PlaybackStatus",
+		DBUS_TYPE_STRING, &status
+	);
+}
+
+void signal_loop_status(DBusConnection *conn, struct player *player) {
+	const char *status = player_loop_status(player);
+	signal_prop_change_one_basic(conn,
+		"org.mpris.MediaPlayer2.Player",
+		"LoopStatus",
+		DBUS_TYPE_STRING, &status
+	);
+}
+
+void signal_volume(DBusConnection *conn, struct player *player) {
+	double volume = player->volume;
+	signal_prop_change_one_basic(conn,
+		"org.mpris.MediaPlayer2.Player",
+		"Volume",
+		DBUS_TYPE_DOUBLE, &volume
+	);
+}
+
+static DBusHandlerResult post(
+	DBusConnection *conn,
+	DBusMessage *msg,
+	struct player *player,
+	cmd proto
+) {
+	cmd *c = malloc(sizeof *c);
+	if (!c) {
+		reply_nothing(conn, msg);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+	*c = proto;
+	c->ack = cmd_ack;
+	c->userdata = dbus_message_ref(msg);
+	player_command(player, c);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
 DBusHandlerResult mp2_player_msg(
 	DBusConnection *conn,
 	DBusMessage *msg,
@@ -527,74 +586,10 @@ DBusHandlerResult mp2_player_msg(
 ) {
 	struct player *player = user_data;
 	if (dbus_message_has_member(msg, "Next")) {
-		mtx_lock(&player->lock);
-		struct playlist *pl = &player->pl;
-		track_i *track;
-		track = pl->track[pl->curr];
-		track->seek(track, 0, SEEK_SET);
-		switch (player->play_mode) {
-		case playlist:
-		case single:
-			pl->curr++;
-			if (pl->curr >= pl->size) {
-				pl->curr = 0;
-				pa_operation *op = pa_stream_cork(player->stream,
-					1, NULL, NULL);
-				pa_operation_unref(op);
-				const char *playback_status = "Stopped";
-				signal_prop_change_one_basic(conn,
-					"org.mpris.MediaPlayer2.Player",
-					"PlaybackStatus",
-					DBUS_TYPE_STRING, &playback_status
-				);
-			}
-			signal_metadata_update(conn, player);
-			break;
-		case repeat:
-			pl->curr++;
-			pl->curr %= pl->size;
-			signal_metadata_update(conn, player);
-			break;
-		case repeat_one: break;
-		}
-		mtx_unlock(&player->lock);
-		reply_nothing(conn, msg);
-		return DBUS_HANDLER_RESULT_HANDLED;
+		return post(conn, msg, player, (cmd) { .type = CMD_NEXT });
 	}
 	if (dbus_message_has_member(msg, "Previous")) {
-		mtx_lock(&player->lock);
-		struct playlist *pl = &player->pl;
-		track_i *track;
-		track = pl->track[pl->curr];
-		track->seek(track, 0, SEEK_SET);
-		switch (player->play_mode) {
-		case playlist:
-		case single:
-			pl->curr--;
-			if (pl->curr < 0) {
-				pl->curr = 0;
-				pa_operation *op = pa_stream_cork(player->stream,
-					1, NULL, NULL);
-				pa_operation_unref(op);
-				const char *playback_status = "Stopped";
-				signal_prop_change_one_basic(conn,
-					"org.mpris.MediaPlayer2.Player",
-					"PlaybackStatus",
-					DBUS_TYPE_STRING, &playback_status
-				);
-			}
-			signal_metadata_update(conn, player);
-			break;
-		case repeat:
-			pl->curr--;
-			pl->curr %= pl->size;
-			signal_metadata_update(conn, player);
-			break;
-		case repeat_one: break;
-		}
-		mtx_unlock(&player->lock);
-		reply_nothing(conn, msg);
-		return DBUS_HANDLER_RESULT_HANDLED;
+		return post(conn, msg, player, (cmd) { .type = CMD_PREVIOUS });
 	}
 	if (dbus_message_has_member(msg, "Pause")) {
 		const char *status = player_playback_status(player);
@@ -602,8 +597,7 @@ DBusHandlerResult mp2_player_msg(
 			reply_nothing(conn, msg);
 			return DBUS_HANDLER_RESULT_HANDLED;
 		}
-		pa_operation *op = pa_stream_cork(player->stream, 1, NULL, NULL);
-		pa_operation_unref(op);
+		player_cork(player, 1);
 		signal_prop_change_one_basic(conn,
 			"org.mpris.MediaPlayer2.Player",
 			"PlaybackStatus",
@@ -614,9 +608,7 @@ DBusHandlerResult mp2_player_msg(
 	}
 	if (dbus_message_has_member(msg, "PlayPause")) {
 		const char *status = player_playback_status(player);
-		pa_operation *op = pa_stream_cork(player->stream,
-			(status == PlaybackPlaying) ? 1 : 0, NULL, NULL);
-		pa_operation_unref(op);
+		player_cork(player, status == PlaybackPlaying);
 		const char *new_status =
 			(status == PlaybackPlaying) ? PlaybackPaused
 			: PlaybackPlaying;
@@ -634,21 +626,7 @@ DBusHandlerResult mp2_player_msg(
 			reply_nothing(conn, msg);
 			return DBUS_HANDLER_RESULT_HANDLED;
 		}
-		mtx_lock(&player->lock);
-		struct playlist *pl = &player->pl;
-		track_i *track = pl->track[pl->curr];
-		track->seek(track, 0, SEEK_SET);
-		pl->curr = 0;
-		pa_operation *op = pa_stream_cork(player->stream, 1, NULL, NULL);
-		pa_operation_unref(op);
-		mtx_unlock(&player->lock);
-		signal_prop_change_one_basic(conn,
-			"org.mpris.MediaPlayer2.Player",
-			"PlaybackStatus",
-			DBUS_TYPE_STRING, &PlaybackStopped
-		);
-		reply_nothing(conn, msg);
-		return DBUS_HANDLER_RESULT_HANDLED;
+		return post(conn, msg, player, (cmd) { .type = CMD_STOP });
 	}
 	if (dbus_message_has_member(msg, "Play")) {
 		const char *status = player_playback_status(player);
@@ -656,8 +634,7 @@ DBusHandlerResult mp2_player_msg(
 			reply_nothing(conn, msg);
 			return DBUS_HANDLER_RESULT_HANDLED;
 		}
-		pa_operation *op = pa_stream_cork(player->stream, 0, NULL, NULL);
-		pa_operation_unref(op);
+		player_cork(player, 0);
 		signal_prop_change_one_basic(conn,
 			"org.mpris.MediaPlayer2.Player",
 			"PlaybackStatus",
@@ -681,17 +658,10 @@ DBusHandlerResult mp2_player_msg(
 			);
 			goto send_reply;
 		}
-		mtx_lock(&player->lock);
-		struct playlist *pl = &player->pl;
-		track_i *track = pl->track[pl->curr];
-		track->seek(track, offset / 1e6, SEEK_CUR);
-		track_state state = track->state(track);
-		dbus_int64_t position = state.time * 1e6;
-		mtx_unlock(&player->lock);
-
-		signal_seeked(conn, position);
-		reply_nothing(conn, msg);
-		return DBUS_HANDLER_RESULT_HANDLED;
+		return post(conn, msg, player, (cmd) {
+			.type = CMD_SEEK,
+			.time = offset / 1e6,
+		});
 	}
 	if (dbus_message_has_member(msg, "SetPosition")) {
 		const char *trackid;
@@ -709,21 +679,20 @@ DBusHandlerResult mp2_player_msg(
 			);
 			goto send_reply;
 		}
-		struct player *player = user_data;
-		struct playlist *pl = &player->pl;
-		mtx_lock(&player->lock);
-		track_i *track = pl->track[pl->curr];
+		pcm_mark now = player_now(player);
 		char buf[] = "/org/mpris/MediaPlayer2/track/??????";
 		snprintf(buf, sizeof buf,
-			"/org/mpris/MediaPlayer2/track/%d", pl->curr);
-		if (!strcmp(buf, trackid)) {
-			track->seek(track, position / 1e6, SEEK_SET);
+			"/org/mpris/MediaPlayer2/track/%d", now.track);
+		// Positions for any other track are to be ignored.
+		if (strcmp(buf, trackid)) {
+			reply_nothing(conn, msg);
+			return DBUS_HANDLER_RESULT_HANDLED;
 		}
-		mtx_unlock(&player->lock);
-
-		signal_seeked(conn, position);
-		reply_nothing(conn, msg);
-		return DBUS_HANDLER_RESULT_HANDLED;
+		return post(conn, msg, player, (cmd) {
+			.type  = CMD_SET_POSITION,
+			.track = now.track,
+			.time  = position / 1e6,
+		});
 	}
 	if (dbus_message_has_member(msg, "OpenUri")) {
 		const char *uri;
@@ -761,8 +730,9 @@ DBusHandlerResult mp2_player_prop_get(
 	void *user_data,
 	const char *property
 ) {
+	// Everything read here is either published for lock-free reading
+	// or only ever changed on this thread.
 	struct player *player = user_data;
-	mtx_lock(&player->lock);
 	DBusMessage *reply = dbus_message_new_method_return(msg);
 	DBusMessageIter iter;
 	dbus_message_iter_init_append(reply, &iter);
@@ -849,7 +819,6 @@ DBusHandlerResult mp2_player_prop_get(
 			"Invalid property"
 		);
 	}
-	mtx_unlock(&player->lock);
 	dbus_connection_send(conn, reply, NULL);
 	dbus_message_unref(reply);
 	return DBUS_HANDLER_RESULT_HANDLED;
@@ -948,9 +917,8 @@ DBusHandlerResult mp2_player_prop_set(
 		}
 		double new_volume;
 		dbus_message_iter_get_basic(&variant, &new_volume);
-		float new_gain = 20*log(new_volume);
 		mtx_lock(&player->lock);
-		player->gain = new_gain;
+		player_set_volume(player, new_volume);
 		signal_prop_change_one_basic(conn,
 			"org.mpris.MediaPlayer2.Player",
 			"Volume",
@@ -1007,7 +975,6 @@ DBusHandlerResult mp2_player_prop_getall(
 	void *user_data
 ) {
 	struct player *player = user_data;
-	mtx_lock(&player->lock);
 	DBusMessage *reply;
 	reply = dbus_message_new_method_return(msg);
 	DBusMessageIter iter, dict, entry, variant;
@@ -1070,7 +1037,6 @@ DBusHandlerResult mp2_player_prop_getall(
 	);
 
 	iter_close_dict(&iter, &dict);
-	mtx_unlock(&player->lock);
 	dbus_connection_send(conn, reply, NULL);
 	dbus_message_unref(reply);
 	return DBUS_HANDLER_RESULT_HANDLED;
@@ -1202,10 +1168,119 @@ DBusObjectPathVTable mp2_vtable = (DBusObjectPathVTable) {
 	.message_function    = obj_msg,
 };
 
-int dbus_main(void *_player) {
-	struct player *player = _player;
-	dbus_threads_init_default();
+static pa_io_event_flags_t watch_events(DBusWatch *watch) {
+	if (!dbus_watch_get_enabled(watch)) return PA_IO_EVENT_NULL;
+	unsigned flags = dbus_watch_get_flags(watch);
+	pa_io_event_flags_t events = PA_IO_EVENT_HANGUP | PA_IO_EVENT_ERROR;
+	if (flags & DBUS_WATCH_READABLE) events |= PA_IO_EVENT_INPUT;
+	if (flags & DBUS_WATCH_WRITABLE) events |= PA_IO_EVENT_OUTPUT;
+	return events;
+}
+
+static void watch_cb(
+	pa_mainloop_api *api,
+	pa_io_event *event,
+	int fd,
+	pa_io_event_flags_t events,
+	void *userdata
+) {
+	unsigned flags = 0;
+	if (events & PA_IO_EVENT_INPUT)  flags |= DBUS_WATCH_READABLE;
+	if (events & PA_IO_EVENT_OUTPUT) flags |= DBUS_WATCH_WRITABLE;
+	if (events & PA_IO_EVENT_HANGUP) flags |= DBUS_WATCH_HANGUP;
+	if (events & PA_IO_EVENT_ERROR)  flags |= DBUS_WATCH_ERROR;
+	dbus_watch_handle(userdata, flags);
+}
+
+static dbus_bool_t watch_add(DBusWatch *watch, void *data) {
+	pa_mainloop_api *api = data;
+	pa_io_event *event = api->io_new(api, dbus_watch_get_unix_fd(watch),
+		watch_events(watch), watch_cb, watch);
+	if (!event) return false;
+	dbus_watch_set_data(watch, event, NULL);
+	return true;
+}
+
+static void watch_remove(DBusWatch *watch, void *data) {
+	pa_mainloop_api *api = data;
+	pa_io_event *event = dbus_watch_get_data(watch);
+	if (event) api->io_free(event);
+	dbus_watch_set_data(watch, NULL, NULL);
+}
+
+static void watch_toggled(DBusWatch *watch, void *data) {
+	pa_mainloop_api *api = data;
+	pa_io_event *event = dbus_watch_get_data(watch);
+	if (event) api->io_enable(event, watch_events(watch));
+}
+
+// D-Bus timeouts repeat until they are removed or disabled.
+static void timeout_arm(pa_mainloop_api *api, pa_time_event *event, DBusTimeout *timeout) {
+	if (!dbus_timeout_get_enabled(timeout)) {
+		api->time_restart(event, NULL);
+		return;
+	}
+	struct timeval tv;
+	pa_usec_t interval =
+		(pa_usec_t) dbus_timeout_get_interval(timeout) * PA_USEC_PER_MSEC;
+	api->time_restart(event,
+		pa_timeval_rtstore(&tv, pa_rtclock_now() + interval, true));
+}
+
+static void timeout_cb(
+	pa_mainloop_api *api,
+	pa_time_event *event,
+	const struct timeval *tv,
+	void *userdata
+) {
+	DBusTimeout *timeout = userdata;
+	dbus_timeout_handle(timeout);
+	timeout_arm(api, event, timeout);
+}
+
+static dbus_bool_t timeout_add(DBusTimeout *timeout, void *data) {
+	pa_mainloop_api *api = data;
+	pa_time_event *event = api->time_new(api, NULL, timeout_cb, timeout);
+	if (!event) return false;
+	dbus_timeout_set_data(timeout, event, NULL);
+	timeout_arm(api, event, timeout);
+	return true;
+}
+
+static void timeout_remove(DBusTimeout *timeout, void *data) {
+	pa_mainloop_api *api = data;
+	pa_time_event *event = dbus_timeout_get_data(timeout);
+	if (event) api->time_free(event);
+	dbus_timeout_set_data(timeout, NULL, NULL);
+}
+
+static void timeout_toggled(DBusTimeout *timeout, void *data) {
+	pa_mainloop_api *api = data;
+	pa_time_event *event = dbus_timeout_get_data(timeout);
+	if (event) timeout_arm(api, event, timeout);
+}
+
+// Incoming messages are dispatched from a deferred event,
+// which stays enabled while any are left.
+static pa_defer_event *dispatch_event;
 
+static void dispatch_cb(pa_mainloop_api *api, pa_defer_event *event, void *userdata) {
+	DBusConnection *conn = userdata;
+	if (dbus_connection_dispatch(conn) != DBUS_DISPATCH_DATA_REMAINS) {
+		api->defer_enable(event, 0);
+	}
+}
+
+static void dispatch_status_cb(
+	DBusConnection *conn,
+	DBusDispatchStatus status,
+	void *data
+) {
+	pa_mainloop_api *api = data;
+	api->defer_enable(dispatch_event, status == DBUS_DISPATCH_DATA_REMAINS);
+}
+
+int dbus_attach(struct player *player, pa_mainloop_api *api) {
 	DBusError dbuserr = {};
 	DBusConnection *conn =
 		dbus_bus_get_private(DBUS_BUS_SESSION, &dbuserr);
@@ -1217,6 +1292,7 @@ int dbus_main(void *_player) {
 		);
 		return -1;
 	}
+	dbus_connection_set_exit_on_disconnect(conn, false);
 
 	int ret = dbus_bus_request_name(
 		conn,
@@ -1271,10 +1347,21 @@ int dbus_main(void *_player) {
 		goto release_name;
 	}
 
+	dispatch_event = api->defer_new(api, dispatch_cb, conn);
+	if (!dispatch_event ||
+		!dbus_connection_set_watch_functions(conn,
+			watch_add, watch_remove, watch_toggled, api, NULL) ||
+		!dbus_connection_set_timeout_functions(conn,
+			timeout_add, timeout_remove, timeout_toggled, api, NULL)) {
+		fprintf(stderr, "unable to watch dbus connection\n");
+		goto release_name;
+	}
+	dbus_connection_set_dispatch_status_function(conn,
+		dispatch_status_cb, api, NULL);
+	api->defer_enable(dispatch_event,
+		dbus_connection_get_dispatch_status(conn) == DBUS_DISPATCH_DATA_REMAINS);
 	player->conn = conn;
-	while (!player->stream);
-
-	while (dbus_connection_read_write_dispatch(conn, 1));
+	return 0;
 
 release_name:
 	dbus_bus_release_name(conn,
@@ -1282,5 +1369,6 @@ release_name:
 		&dbuserr);
 close_conn:
 	dbus_connection_close(conn);
-	return 0;
+	dbus_connection_unref(conn);
+	return -1;
 }
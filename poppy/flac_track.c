@@ -22,18 +22,18 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <string.h>
 #include <threads.h>
 #include <assert.h>
-#include <math.h>
 #include <ctype.h>
 
 #include <FLAC/stream_decoder.h>
-#include <libswresample/swresample.h>
-#include <speex/speex_resampler.h>
 
 #include "poppy.h"
 #include "track.h"
 #include "flac_track.h"
 #include "def.h"
 #include "ch_map.h"
+#include "resample.h"
+#include "conv.h"
+#include "input.h"
 
 FLAC__StreamDecoderReadStatus flac_read_callback(
 	const FLAC__StreamDecoder *decoder,
@@ -42,29 +42,14 @@ FLAC__StreamDecoderReadStatus flac_read_callback(
 	void *client_data
 ) {
 	flac_track *track = client_data;
-	flac_stream *stream = &track->stream;
-	if (stream->index >= stream->length) {
-		return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
-	}
-	if (stream->index + *bytes > stream->length) {
-		*bytes = stream->length - stream->index;
-	}
-	for (;;) {
-		int n = fread(buffer, 1, *bytes, stream->file);
-		if (n > 0) {
-			stream->index += n;
-			*bytes = n;
-			return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
-		}
-		if (feof(stream->file)) {
-			*bytes = 0;
-			return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
-		}
-		if (ferror(stream->file)) {
-			*bytes = 0;
-			return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
-		}
+	long n = input_read(&track->stream, buffer, *bytes);
+	if (n < 0) {
+		*bytes = 0;
+		return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
 	}
+	*bytes = n;
+	if (n == 0) return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
 }
 
 FLAC__StreamDecoderSeekStatus flac_seek_callback(
@@ -73,19 +58,7 @@ FLAC__StreamDecoderSeekStatus flac_seek_callback(
 	void *client_data
 ) {
 	flac_track *track = client_data;
-	flac_stream *stream = &track->stream;
-	FLAC__uint64 offset = absolute_byte_offset;
-	long real_offset;
-	real_offset = offset - stream->index;
-	stream->index = offset;
-	if (real_offset < -stream->length) {
-		real_offset = -stream->length;
-		stream->index = 0;
-	} else if (real_offset > stream->length) {
-		real_offset = stream->length - stream->index;
-		stream->index = stream->length;
-	}
-	if (!fseek(stream->file, real_offset, SEEK_CUR)) {
+	if (!input_seek(&track->stream, absolute_byte_offset, SEEK_SET)) {
 		return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
 	} else {
 		return FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
@@ -98,8 +71,7 @@ FLAC__StreamDecoderTellStatus flac_tell_callback(
 	void *client_data
 ) {
 	flac_track *track = client_data;
-	flac_stream *stream = &track->stream;
-	*absolute_byte_offset = stream->index;
+	*absolute_byte_offset = input_tell(&track->stream);
 	return FLAC__STREAM_DECODER_TELL_STATUS_OK;
 }
 
@@ -109,8 +81,7 @@ FLAC__StreamDecoderLengthStatus flac_length_callback(
 	void *client_data
 ) {
 	flac_track *track = client_data;
-	flac_stream *stream = &track->stream;
-	*stream_length = stream->length;
+	*stream_length = track->stream.length;
 	return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
 }
 
@@ -119,11 +90,23 @@ FLAC__bool flac_eof_callback(
 	void *client_data
 ) {
 	flac_track *track = client_data;
-	flac_stream *stream = &track->stream;
-	return stream->index >= stream->length;
+	return input_eof(&track->stream);
 }
 
 
+// Cache line aligned, to suit the conversion kernels.
+static int frame_reserve(flac_frame *frame, int chn, int samples) {
+	if (samples <= frame->capacity) return 0;
+	size_t bytes = (size_t) chn*samples * sizeof *frame->buffer;
+	bytes = (bytes + 63) & ~(size_t) 63;
+	float *buffer = aligned_alloc(64, bytes);
+	if (!buffer) return -1;
+	free(frame->buffer);
+	frame->buffer = buffer;
+	frame->capacity = samples;
+	return 0;
+}
+
 FLAC__StreamDecoderWriteStatus flac_write_callback(
 	const FLAC__StreamDecoder *decoder,
 	const FLAC__Frame *frame,
@@ -134,13 +117,14 @@ FLAC__StreamDecoderWriteStatus flac_write_callback(
 
 	int chn = track->meta.channels;
 	int sn = frame->header.blocksize;
-	int depth = 1-frame->header.bits_per_sample;
-	track->frame.buffer = realloc(track->frame.buffer, chn*sn * sizeof (float));
-	for (int ch = 0; ch < chn; ch++) {
-		for (int s = 0; s < sn; s++) {
-			track->frame.buffer[chn*s+ch] = ldexpf(buffer[ch][s], depth);
-		}
+	// Only a stream that lies about its max block size gets here.
+	if (frame_reserve(&track->frame, chn, sn) < 0) {
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
 	}
+	conv_s32_planar(
+		track->frame.buffer, buffer, flac_vorbis_ch_map[chn],
+		chn, sn, frame->header.bits_per_sample
+	);
 	track->frame.samples = sn;
 	track->frame.consumed = 0;
 	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
@@ -199,6 +183,8 @@ void flac_metadata_callback(
 		track->meta.bit_rate =
 			track->stream.length / 8 /
 				track->meta.length;
+		frame_reserve(&track->frame,
+			stream_info.channels, stream_info.max_blocksize);
 		break;
 	}
 	case FLAC__METADATA_TYPE_VORBIS_COMMENT: {
@@ -236,35 +222,35 @@ track_meta flac_track_meta(track_i *this) {
 
 int flac_track_dec(track_i *this, float *pcm, int samples) {
 	flac_track *track = (flac_track*) this;
-
-	if (track->frame.consumed == track->frame.samples) {
-		FLAC__stream_decoder_process_single(track->dec);
-	}
 	int chn = track->meta.channels;
-	int consumed = track->frame.consumed;
-	int available = track->frame.samples - consumed;
-	spx_uint32_t in_len, out_len;
-	for (int ch = 0; ch < chn; ch++) {
-		in_len  = available;
-		out_len = samples;
-		speex_resampler_process_float(
-			track->resampler, ch,
-			&track->frame.buffer[chn*consumed+ch], &in_len,
-			&pcm[vorbis_vorbis81_ch_map[chn][flac_vorbis_ch_map[chn][ch]]], &out_len
-		);
-	}
-	float scale = powf(10, track->state.gain/20);
-	switch (track->state.gain_type) {
-	case album_gain: scale *= powf(10, track->album_gain/20); break;
-	case track_gain: scale *= powf(10, track->track_gain/20); break;
-	default: break;
-	}
-	for (int s = 0; s < stream_channel_cnt*out_len; s++) {
-		pcm[s] *= scale;
+	for (;;) {
+		if (track->frame.consumed == track->frame.samples) {
+			FLAC__stream_decoder_process_single(track->dec);
+		}
+		int consumed = track->frame.consumed;
+		int available = track->frame.samples - consumed;
+		const float *in = &track->frame.buffer[chn*consumed];
+		int in_len, out_len;
+		if (available == 0) {
+			// Out of frames; all that is left is the resampler's tail.
+			in_len  = 0;
+			out_len = track->resampler ?
+				resampler_drain(track->resampler, pcm, samples) : 0;
+		} else if (!track->resampler) {
+			in_len = out_len = available < samples ? available : samples;
+			memcpy(pcm, in, chn*out_len * sizeof *pcm);
+		} else {
+			in_len  = available;
+			out_len = samples;
+			resampler_process(track->resampler,
+				in, &in_len, pcm, &out_len);
+		}
+		track->state.time += out_len / (float) track->meta.dec_rate;
+		track->frame.consumed += in_len;
+		// The resampler may take the last frames of a block without
+		// giving anything back yet, but 0 is only for the end.
+		if (out_len > 0 || in_len == 0) return out_len;
 	}
-	track->state.time += out_len / (float) stream_sample_rate;
-	track->frame.consumed += in_len;
-	return out_len;
 }
 
 int flac_track_seek(track_i *this, float offset, int whence) {
@@ -295,21 +281,28 @@ int flac_track_seek(track_i *this, float offset, int whence) {
 		track->dec,
 		real_offset * track->meta.sample_rate
 	);
+	if (track->resampler) resampler_reset(track->resampler);
 	return ret;
 }
 
+static void update_scale(flac_track *track) {
+	track_state_scale(&track->state, track->album_gain, track->track_gain);
+}
+
 int flac_track_gain(track_i *this, float gain, int whence) {
 	flac_track *track = (flac_track*) this;
 	switch (whence) {
 	case SEEK_SET: track->state.gain = gain; break;
 	case SEEK_CUR: track->state.gain += gain; break;
 	}
+	update_scale(track);
 	return 0;
 }
 
 int flac_track_gain_type(track_i *this, enum gain_type gain_type) {
 	flac_track *track = (flac_track*) this;
 	track->state.gain_type = gain_type;
+	update_scale(track);
 	return 0;
 }
 
@@ -325,6 +318,9 @@ int flac_track_close(track_i *this) {
 	free_if_null(track->meta.tracknumber);
 	free_if_null(track->meta.tracktotal);
 	FLAC__stream_decoder_delete(track->dec);
+	input_close(&track->stream);
+	resampler_free(track->resampler);
+	free(track->frame.buffer);
 	return 0;
 }
 
@@ -354,21 +350,18 @@ int flac_track_from_file(
 		FLAC__METADATA_TYPE_VORBIS_COMMENT
 	);
 
+	if (input_open(&track->stream, filename, link_start, link_end) < 0) {
+		goto fail;
+	}
 	FLAC__StreamDecoderInitStatus status;
 	if (!isogg) {
-		status = FLAC__stream_decoder_init_file(
-			track->dec,
-			filename,
-			flac_write_callback,
-			flac_metadata_callback,
-			flac_error_callback,
-			track
-		);
-	}
-	else if (link_start == 0 && link_end == -1) {
-		status = FLAC__stream_decoder_init_ogg_file(
+		status = FLAC__stream_decoder_init_stream(
 			track->dec,
-			filename,
+			flac_read_callback,
+			flac_seek_callback,
+			flac_tell_callback,
+			flac_length_callback,
+			flac_eof_callback,
 			flac_write_callback,
 			flac_metadata_callback,
 			flac_error_callback,
@@ -376,18 +369,6 @@ int flac_track_from_file(
 		);
 	}
 	else {
-		FILE *file = fopen(filename, "r");
-		if (!file) {
-			fprintf(stderr, "fopen: %s: ", filename);
-			perror("");
-			return -1;
-		}
-		fseek(file, link_start, SEEK_CUR);
-		track->stream = (flac_stream) {
-			.file   = file,
-			.index  = 0,
-			.length = link_end,
-		};
 		status = FLAC__stream_decoder_init_ogg_stream(
 			track->dec,
 			flac_read_callback,
@@ -403,19 +384,24 @@ int flac_track_from_file(
 	}
 	if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
 		fprintf(stderr, "unable to init FLAC decoder\n");
-		return -1;
+		goto fail;
 	}
 
 	FLAC__stream_decoder_process_until_end_of_metadata(track->dec);
-	
-	int speex_err;
-	track->resampler = speex_resampler_init(
-		stream_channel_cnt,
-		track->meta.sample_rate, stream_sample_rate,
-		10, &speex_err
+	update_scale(track);
+	track->meta.dec_rate = output_rate(track->meta.sample_rate);
+	if (track->meta.dec_rate == track->meta.sample_rate) return 0;
+
+	track->resampler = resampler_new(
+		track->meta.channels,
+		track->meta.sample_rate, track->meta.dec_rate,
+		false
 	);
-	speex_resampler_set_input_stride(track->resampler, track->meta.channels);
-	speex_resampler_set_output_stride(track->resampler, stream_channel_cnt);
+	if (!track->resampler) goto fail;
 
 	return 0;
+fail:
+	// Everything not yet set up is still zero, which close skips.
+	flac_track_close((track_i*) track);
+	return -1;
 }
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include "track.h"
+
+struct player;
+
+// Maps the index of files probed by earlier runs, if there is one.
+void cache_load(void);
+
+// Gives the tracks of filename as they were last probed,
+// or returns -1 if the file is not indexed or has changed since.
+int cache_lookup(const char *filename, track_desc **descs);
+
+// Indexes every file on the playlist, unless nothing new was
+// learned about them since the last save.
+void cache_save(struct player *player);
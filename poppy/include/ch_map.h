@@ -164,28 +164,3 @@ static const int flac_vorbis_ch_map[9][8] = {
 	[flac_6_1_surround]    = { 0, 2, 1, 6, 5, 3, 4 },
 	[flac_7_1_surround]    = { 0, 2, 1, 7, 5, 6, 3, 4 },
 };
-
-static const int vorbis_vorbis8_ch_map[9][8] = {
-	[vorbis_silence]         = { 0 },
-	[vorbis_mono]            = { 1 },
-	[vorbis_stereo]          = { 0, 2 },
-	[vorbis_linear_surround] = { 0, 1, 2 },
-	[vorbis_quadraphonic]    = { 0, 2, 5, 6 },
-	[vorbis_5_0_surround]    = { 0, 1, 2, 5, 6 },
-	[vorbis_5_1_surround]    = { 0, 1, 2, 5, 6, 7 },
-	[vorbis_6_1_surround]    = { 0, 1, 2, 3, 4, 5, 7 },
-	[vorbis_7_1_surround]    = { 0, 1, 2, 3, 4, 5, 6, 7 },
-};
-
-static const int vorbis_vorbis81_ch_map[10][9] = {
-	[vorbis_silence]         = { 0 },
-	[vorbis_mono]            = { 1 },
-	[vorbis_stereo]          = { 0, 2 },
-	[vorbis_linear_surround] = { 0, 1, 2 },
-	[vorbis_quadraphonic]    = { 0, 2, 5, 7 },
-	[vorbis_5_0_surround]    = { 0, 1, 2, 5, 7 },
-	[vorbis_5_1_surround]    = { 0, 1, 2, 5, 7, 8 },
-	[vorbis_6_1_surround]    = { 0, 1, 2, 3, 4, 6, 8 },
-	[vorbis_7_1_surround]    = { 0, 1, 2, 3, 4, 5, 7, 8 },
-	[vorbis_8_1_surround]    = { 0, 1, 2, 3, 4, 5, 6, 7, 8 },
-};
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+struct player;
+struct cmd;
+
+enum cmd_type {
+	CMD_NEXT,
+	CMD_PREVIOUS,
+	// By time seconds.
+	CMD_SEEK,
+	// To time seconds into track, if it is still playing.
+	CMD_SET_POSITION,
+	CMD_STOP,
+};
+
+// Called on the mainloop once the command has been carried out.
+typedef void cmd_ack_fn(struct player *player, struct cmd *cmd);
+
+typedef struct cmd {
+	struct cmd *next;
+	enum cmd_type type;
+	int track;
+	double time;
+	cmd_ack_fn *ack;
+	void *userdata;
+	// Times the stream had been corked or uncorked when it was posted.
+	unsigned corks;
+	// Where the batch the command was coalesced into left playback.
+	int done_track;
+	double done_time;
+	bool changed;
+	bool stopped;
+	// Only set on the last command of its batch, so that whatever
+	// the batch as a whole calls for is done once.
+	bool last;
+} cmd;
+
+// Lock-free for any number of producers and one consumer.
+typedef struct cmd_queue {
+	_Atomic(cmd*) head;
+} cmd_queue;
+
+void cmd_push(cmd_queue *queue, cmd *cmd);
+
+// Takes everything queued, oldest first.
+cmd *cmd_take(cmd_queue *queue);
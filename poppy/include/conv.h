@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+// Converts planar integer samples of the given bit depth to
+// interleaved float. Input channel ch is written to position order[ch].
+void conv_s32_planar(
+	float *out,
+	const int32_t *const *in,
+	const int *order,
+	int channels,
+	int frames,
+	int bits
+);
+
+// Interleaves planar float samples, channel order unchanged.
+void conv_f32_planar(
+	float *out,
+	const float *const *in,
+	int channels,
+	int frames
+);
@@ -19,4 +19,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #pragma once
 
-void write_pid_file(void);
+// Serves poppyctl on a Unix socket, from the PulseAudio mainloop.
+// Requests and replies are lines; see poppyctl.
+int ctl_attach(struct player*, pa_mainloop_api*);
+
+void ctl_detach(pa_mainloop_api*);
@@ -19,6 +19,17 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #pragma once
 
-int dbus_main(void*);
+// Serves MPRIS from the PulseAudio mainloop, on the same thread.
+int dbus_attach(struct player*, pa_mainloop_api*);
 
 void signal_metadata_update(DBusConnection*, struct player*);
+
+void signal_playback_status(DBusConnection*, struct player*);
+
+void signal_loop_status(DBusConnection*, struct player*);
+
+void signal_volume(DBusConnection*, struct player*);
+
+void signal_commanded(DBusConnection*, const cmd*);
+
+const char *player_playback_status(struct player*);
@@ -20,16 +20,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #pragma once
 
 #include <FLAC/stream_decoder.h>
-#include <speex/speex_resampler.h>
 
-typedef struct flac_stream {
-	FILE *file;
-	long index;
-	long length;
-} flac_stream;
+#include "resample.h"
+#include "input.h"
 
 typedef struct flac_frame {
 	float *buffer;
+	int capacity;
 	int samples;
 	int consumed;
 } flac_frame;
@@ -40,10 +37,10 @@ typedef struct flac_track {
 	track_meta meta;
 	float album_gain;
 	float track_gain;
-	flac_stream stream;
+	input stream;
 	FLAC__StreamDecoder *dec;
 	flac_frame frame;
-	SpeexResamplerState *resampler;
+	resampler *resampler;
 } flac_track;
 
 int flac_track_from_file(
@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Shared by every input open on the same file.
+typedef struct input_file {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	void *map;
+	long size;
+	int refs;
+	struct input_file *next;
+} input_file;
+
+// A byte range of a file for the decoders to read. The file is
+// mapped when it can be, and read with pread when it cannot.
+typedef struct input {
+	input_file *file;
+	// The range itself, inside the mapping.
+	const unsigned char *data;
+	long start;
+	long length;
+	long index;
+	// End of what has been asked to be read in ahead of index.
+	long ahead;
+	// Where the last read ended, to tell streaming from seeking.
+	long next;
+	unsigned long reads;
+} input;
+
+// How far ahead of the decoders to read, in bytes.
+extern long readahead_bytes;
+
+// Of a sample of reads, those that found their bytes already in
+// memory, and those that had to wait for the disk.
+typedef struct input_stats {
+	unsigned long hits;
+	unsigned long misses;
+} input_stats;
+
+input_stats input_get_stats(void);
+
+// Starts reading in the first readahead_bytes of a range,
+// without waiting for them.
+void input_prefetch(const char *filename, long start);
+
+// Opens [start, end) of filename, or from start to the end of the
+// file if end is -1 or not past start.
+int input_open(input *in, const char *filename, long start, long end);
+
+void input_close(input *in);
+
+// Copies up to bytes from the current position, returning how many
+// were read, 0 at the end of the range, or -1 on error.
+long input_read(input *in, void *buf, long bytes);
+
+// Positions are relative to the start of the range, and are kept
+// inside it.
+int input_seek(input *in, long offset, int whence);
+
+long input_tell(input *in);
+
+bool input_eof(input *in);
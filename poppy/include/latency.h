@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <pulse/pulseaudio.h>
+
+enum latency_profile {
+	// Whatever the server picks, about 2 seconds.
+	latency_default,
+	latency_interactive,
+	latency_powersave,
+};
+
+typedef struct latency_stats {
+	unsigned long underruns;
+	// Seconds after the first stream was opened.
+	double first;
+	double last;
+	// What tlength has been grown to, 0 if it has not.
+	long grown_ms;
+} latency_stats;
+
+extern enum latency_profile latency_profile;
+// Override the profile's tlength and minreq, unless 0.
+extern long latency_target_ms;
+extern long latency_request_ms;
+
+int latency_profile_from_name(const char *name);
+
+// How much the server asks for at a time, in milliseconds, 0 if unknown.
+long latency_request(void);
+
+// Returns attr filled in for a stream of spec,
+// or NULL to leave it to the server.
+pa_buffer_attr *latency_buffer_attr(
+	pa_buffer_attr *attr,
+	const pa_sample_spec *spec
+);
+
+// Counts an underrun, and grows tlength if they keep coming.
+void latency_underrun(pa_stream *stream);
+
+// Shrinks tlength back once playback has been steady for long enough.
+void latency_check(pa_stream *stream);
+
+latency_stats latency_get_stats(void);
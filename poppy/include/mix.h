@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+
+#include <pulse/pulseaudio.h>
+
+#define MIX_MAX_IN  8
+#define MIX_MAX_OUT PA_CHANNELS_MAX
+
+struct mix_matrix;
+
+typedef void mix_fn(
+	const struct mix_matrix *mix,
+	float *out, const float *in, int frames
+);
+
+// Maps frames in Vorbis channel order onto the stream's channel map.
+// coef[i] is the column for input channel i,
+// padded so that it can be loaded four outputs at a time.
+typedef struct mix_matrix {
+	int in;
+	int out;
+	bool identity;
+	// Each output only depends on the input in its place,
+	// all scaled by gain, so it may be applied in place.
+	bool diagonal;
+	float gain;
+	mix_fn *kernel;
+	_Alignas(16) float coef[MIX_MAX_IN][MIX_MAX_OUT];
+} mix_matrix;
+
+void mix_init(mix_matrix *mix, int channels, const pa_channel_map *map);
+
+// Copies src with every coefficient multiplied by scale.
+void mix_scale(mix_matrix *mix, const mix_matrix *src, float scale);
+
+void mix_apply(const mix_matrix *mix, float *out, const float *in, int frames);
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include "track.h"
+
+typedef struct ogg_link {
+	enum codec codec;
+	bool known;
+	long start;
+	long end;
+} ogg_link;
+
+// Finds the links of a chained Ogg file from page headers alone,
+// bisecting over serial numbers instead of reading page bodies.
+// Returns the number of links, or -1 on error.
+int ogg_scan_links(const char *filename, ogg_link **links);
@@ -21,17 +21,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <opusfile.h>
 
-typedef struct opus_stream {
-	FILE *file;
-	long index;
-	long length;
-} opus_stream;
+#include "input.h"
 
 typedef struct opus_track {
 	track_i track_i;
 	track_state state;
 	track_meta meta;
-	opus_stream stream;
+	input stream;
 	OggOpusFile *file;
 } opus_track;
 
@@ -20,6 +20,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #pragma once
 
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <threads.h>
 
 #include <pulse/pulseaudio.h>
@@ -27,22 +28,104 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "def.h"
 #include "track.h"
+#include "ring.h"
+#include "cmd.h"
+#include "mix.h"
 
 extern const int stream_sample_rate;
-extern const int stream_channel_cnt;
+extern int stream_channel_cnt;
+extern bool native_rate;
+extern bool server_volume;
+extern int decoder_pool;
+
+int output_rate(int sample_rate);
 
 struct playlist {
+	track_desc *desc;
+	// Open decoders, NULL for tracks that are closed.
 	track_i **track;
 	int curr;
 	int size;
+	// Indices of the open tracks.
+	int *open;
+	int open_cnt;
+	// Held, along with player->lock, while the playlist grows,
+	// so that player_meta() can do without player->lock.
+	mtx_t lock;
 };
 
+// What is playing, as last heard by the mainloop.
+typedef struct now_playing {
+	pcm_mark mark;
+	double position;
+	bool playing;
+	bool has_meta;
+	track_meta meta;
+} now_playing;
+
 struct player {
 	struct playlist pl;
 	double gain;
+	// MPRIS volume, linear.
+	double volume;
 	enum gain_type gain_type;
 	enum play_mode play_mode;
 	pa_stream *stream;
 	DBusConnection *conn;
 	mtx_t lock;
+	pa_mainloop *loop;
+	// Rate of the stream, and whether it is being replaced.
+	int rate;
+	bool reopening;
+	// The server queue was emptied on purpose since the last write.
+	bool flushed;
+	long buffer_ms;
+	pcm_ring ring;
+	mix_matrix mix[MIX_MAX_IN+1];
+	float *scratch;
+	atomic_uint gen;
+	// What the stream was last sent was decoded after this jump.
+	unsigned written_gen;
+	atomic_bool starved;
+	atomic_bool failed;
+	// Set while probe workers may still add to the playlist.
+	atomic_bool probing;
+	pcm_mark cursor;
+	// Where in its track playback joined the cursor's track.
+	double cursor_origin;
+	// Control commands for the decode thread, and those it has
+	// carried out, for the mainloop to acknowledge.
+	cmd_queue cmds;
+	cmd_queue acks;
+	unsigned corks;
+	// A seqlock: odd while now is being written, which takes now_lock.
+	atomic_uint now_seq;
+	now_playing now;
+	mtx_t now_lock;
 };
+
+now_playing player_snapshot(struct player *player);
+
+pcm_mark player_now(struct player *player);
+
+float player_position(struct player *player);
+
+void player_update_position(struct player *player);
+
+void player_cork(struct player *player, bool cork);
+
+void player_command(struct player *player, cmd *cmd);
+
+void player_acks(struct player *player);
+
+float player_buffer_fill(struct player *player);
+
+void player_set_volume(struct player *player, double volume);
+
+void player_append(struct player *player, const track_desc *descs, int n);
+
+track_i *player_track(struct player *player, int track);
+
+bool player_meta(struct player *player, int track, track_meta *meta);
+
+void player_jump(struct player *player, int track, float time);
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+struct player;
+
+typedef struct probe probe;
+
+// Probes files on a pool of worker threads. Their tracks are added
+// to the player's playlist in the order the files were given,
+// each as soon as every file before it is done.
+probe *probe_start(struct player *player, char **files, int cnt, int workers);
+
+// Blocks until the playlist has a track or every file is probed,
+// and returns the size of the playlist.
+int probe_wait(probe *probe);
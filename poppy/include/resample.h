@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+
+#include <speex/speex_resampler.h>
+
+enum resample_quality {
+	resample_fast,
+	resample_default,
+	resample_best,
+};
+
+enum resample_backend {
+	resample_speex,
+	resample_swr,
+};
+
+extern enum resample_quality resample_quality;
+extern enum resample_backend resample_backend;
+
+// Converts frames of one rate to another.
+// Input is either interleaved or one buffer per channel,
+// output is always interleaved.
+typedef struct resampler {
+	int channels;
+	int in_rate;
+	int out_rate;
+	bool planar;
+	SpeexResamplerState *speex;
+	struct SwrContext *swr;
+	// Input frames still held back by the filter.
+	int tail;
+	// Planar speex output, one run of scratch_len per channel.
+	float *scratch;
+	int scratch_len;
+} resampler;
+
+resampler *resampler_new(int channels, int in_rate, int out_rate, bool planar);
+
+void resampler_free(resampler *r);
+
+void resampler_reset(resampler *r);
+
+// Lengths are in frames; on return they hold what was
+// consumed and what was produced.
+void resampler_process(
+	resampler *r,
+	const float *in, int *in_len,
+	float *out, int *out_len
+);
+
+void resampler_process_planar(
+	resampler *r,
+	float *const *in, int offset, int *in_len,
+	float *out, int *out_len
+);
+
+// Once the input has ended, returns what the filter held back.
+// Returns 0 when there is nothing left.
+int resampler_drain(resampler *r, float *out, int out_len);
+
+int resample_quality_from_name(const char *name);
+
+int resample_backend_from_name(const char *name);
@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+// pcm_ring_wait also waits for this many free marks.
+#define PCM_MARKS_PER_CHUNK 8
+
+enum pcm_mark_flags {
+	PCM_MARK_CORK = 1,
+};
+
+// Describes the samples written after it, up to the next mark.
+typedef struct pcm_mark {
+	size_t at;
+	unsigned gen;
+	int track;
+	float time;
+	int rate;
+	int flags;
+} pcm_mark;
+
+// Single producer, single consumer ring of interleaved samples.
+// Counters only ever grow; positions are taken modulo size.
+typedef struct pcm_ring {
+	float *pcm;
+	// Atomic only so that a producer in pcm_ring_wait
+	// may look at them while the ring grows.
+	atomic_size_t size;
+	atomic_size_t head;
+	atomic_size_t tail;
+	pcm_mark *mark;
+	atomic_size_t mark_size;
+	atomic_size_t mark_head;
+	atomic_size_t mark_tail;
+	atomic_bool waiting;
+	// Set by pcm_ring_wake, under lock.
+	bool woken;
+	mtx_t lock;
+	cnd_t cond;
+} pcm_ring;
+
+int pcm_ring_init(pcm_ring *ring, size_t samples, size_t marks);
+
+void pcm_ring_free(pcm_ring *ring);
+
+// Neither side may touch the ring meanwhile,
+// except for a producer waiting in pcm_ring_wait.
+int pcm_ring_grow(pcm_ring *ring, size_t samples, size_t marks);
+
+size_t pcm_ring_fill(pcm_ring *ring);
+
+size_t pcm_ring_space(pcm_ring *ring);
+
+float *pcm_ring_write_ptr(pcm_ring *ring, size_t *samples);
+
+void pcm_ring_commit(pcm_ring *ring, size_t samples);
+
+bool pcm_ring_push_mark(pcm_ring *ring, const pcm_mark *mark);
+
+void pcm_ring_wait(pcm_ring *ring, size_t samples);
+
+void pcm_ring_idle(pcm_ring *ring, long ms);
+
+const float *pcm_ring_read_ptr(pcm_ring *ring, size_t *samples);
+
+void pcm_ring_consume(pcm_ring *ring, size_t samples);
+
+bool pcm_ring_peek_mark(pcm_ring *ring, pcm_mark *mark);
+
+void pcm_ring_pop_mark(pcm_ring *ring);
+
+void pcm_ring_wake(pcm_ring *ring);
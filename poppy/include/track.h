@@ -19,14 +19,23 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdatomic.h>
+
 #include "def.h"
 
 typedef struct track_state {
 	float time;
 	float gain;
 	enum gain_type gain_type;
+	// Linear gain the player still has to apply to dec() output.
+	float scale;
 } track_state;
 
+// Sets scale from the gain, the gain type, and the file's own gains.
+// Only recomputed when the gain changes, not per decoded chunk.
+void track_state_scale(track_state *state, float album, float track);
+
 enum codec {
 	OPUS,
 	VORBIS,
@@ -38,6 +47,7 @@ typedef struct track_meta {
 	int channels;
 	int bit_depth;
 	int sample_rate;
+	int dec_rate;
 	float length;
 	int bit_rate;
 	const char *artist;
@@ -50,6 +60,7 @@ typedef struct track_meta {
 typedef struct track_i {
 	track_state (*state)(struct track_i *this);
 	track_meta (*meta)(struct track_i *this);
+	// Interleaved in Vorbis channel order, at dec_rate.
 	int (*dec)(struct track_i *this, float *pcm, int samples);
 	int (*seek)(struct track_i *this, float offset, int whence);
 	int (*gain)(struct track_i *this, float gain, int whence);
@@ -57,7 +68,29 @@ typedef struct track_i {
 	int (*close)(struct track_i *this);
 } track_i;
 
-int tracks_from_file(
-	track_i ***tracks,
+// Enough to open a track later, without keeping its decoder around.
+typedef struct track_desc {
+	const char *filename;
+	enum codec codec;
+	bool isogg;
+	long link_start;
+	long link_end;
+	// Set when the track could not be opened.
+	bool broken;
+	// Filled in the first time the track is opened,
+	// after which it never changes.
+	atomic_bool has_meta;
+	track_meta meta;
+} track_desc;
+
+int track_descs_from_file(
+	track_desc **descs,
 	const char *filename
 );
+
+track_i *track_open(const track_desc *desc);
+
+// Fills in desc->meta from its open track, the first time only.
+void track_desc_meta(track_desc *desc, track_i *track);
+
+void track_close(track_i *track);
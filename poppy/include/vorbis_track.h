@@ -20,13 +20,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #pragma once
 
 #include <vorbis/vorbisfile.h>
-#include <speex/speex_resampler.h>
 
-typedef struct vorbis_stream {
-	FILE *file;
-	long index;
-	long length;
-} vorbis_stream;
+#include "resample.h"
+#include "input.h"
 
 typedef struct vorbis_frame {
 	float **pcm;
@@ -40,10 +36,10 @@ typedef struct vorbis_track {
 	track_meta meta;
 	float album_gain;
 	float track_gain;
-	vorbis_stream stream;
+	input stream;
 	OggVorbis_File file;
 	vorbis_frame frame;
-	SpeexResamplerState *resampler;
+	resampler *resampler;
 } vorbis_track;
 
 int vorbis_track_from_file(
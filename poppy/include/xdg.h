@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <sys/types.h>
+
+void xdg_state_home(char *path);
+
+void xdg_cache_home(char *path);
+
+void xdg_runtime_dir(char *path);
+
+int mkdirp(const char *path, mode_t mode);
+
+// Where poppy listens for poppyctl, with its directory made if create.
+int ctl_socket_path(char *path, size_t size, bool create);
@@ -0,0 +1,263 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+// For mincore and preadv2.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <threads.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "input.h"
+
+long readahead_bytes = 2 << 20;
+
+// Only one read in this many is checked for being in memory,
+// to keep the check's syscall off most reads.
+#define SAMPLE_EVERY 16
+
+static atomic_ulong hits;
+static atomic_ulong misses;
+
+// Files with an input open on them, so that the links of a chain
+// share one mapping or descriptor rather than each opening their own.
+static input_file *files;
+static mtx_t files_lock;
+static once_flag files_once = ONCE_FLAG_INIT;
+
+static void files_init(void) {
+	mtx_init(&files_lock, mtx_plain);
+}
+
+static input_file *file_acquire(const char *filename) {
+	call_once(&files_once, files_init);
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open: %s: ", filename);
+		perror("");
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "fstat: %s: ", filename);
+		perror("");
+		close(fd);
+		return NULL;
+	}
+	mtx_lock(&files_lock);
+	for (input_file *file = files; file; file = file->next) {
+		// A file replaced under the same name is a new file.
+		if (file->dev != st.st_dev || file->ino != st.st_ino) continue;
+		file->refs++;
+		mtx_unlock(&files_lock);
+		close(fd);
+		return file;
+	}
+	input_file *file = calloc(1, sizeof *file);
+	if (!file) {
+		mtx_unlock(&files_lock);
+		close(fd);
+		return NULL;
+	}
+	*file = (input_file) {
+		.fd   = fd,
+		.dev  = st.st_dev,
+		.ino  = st.st_ino,
+		.size = st.st_size,
+		.refs = 1,
+		.next = files,
+	};
+	if (file->size > 0) {
+		void *map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			file->map = map;
+			close(fd);
+			file->fd = -1;
+		}
+	}
+	files = file;
+	mtx_unlock(&files_lock);
+	return file;
+}
+
+static void file_release(input_file *file) {
+	mtx_lock(&files_lock);
+	if (--file->refs > 0) {
+		mtx_unlock(&files_lock);
+		return;
+	}
+	for (input_file **link = &files; *link; link = &(*link)->next) {
+		if (*link != file) continue;
+		*link = file->next;
+		break;
+	}
+	mtx_unlock(&files_lock);
+	if (file->map) munmap(file->map, file->size);
+	if (file->fd >= 0) close(file->fd);
+	free(file);
+}
+
+int input_open(input *in, const char *filename, long start, long end) {
+	*in = (input) { 0 };
+	input_file *file = file_acquire(filename);
+	if (!file) return -1;
+	// An empty range is the whole file too, as some descs, like those
+	// cached for FLAC before it was given an end, have it.
+	if (end <= start || end > file->size) end = file->size;
+	if (start > end) start = end;
+	*in = (input) {
+		.file   = file,
+		.start  = start,
+		.length = end - start,
+	};
+	if (file->map) in->data = (const unsigned char*) file->map + start;
+	return 0;
+}
+
+void input_close(input *in) {
+	if (in->file) file_release(in->file);
+	*in = (input) { 0 };
+}
+
+input_stats input_get_stats(void) {
+	return (input_stats) {
+		.hits   = atomic_load(&hits),
+		.misses = atomic_load(&misses),
+	};
+}
+
+// Keeps at least half the read-ahead window requested past index,
+// topping it up a half window at a time.
+static void read_ahead(input *in) {
+	if (readahead_bytes <= 0) return;
+	if (in->ahead >= in->length) return;
+	if (in->ahead - in->index >= readahead_bytes / 2) return;
+	long from = in->ahead > in->index ? in->ahead : in->index;
+	long to = in->index + readahead_bytes;
+	if (to > in->length) to = in->length;
+	in->ahead = to;
+	if (in->data) {
+		long page = sysconf(_SC_PAGESIZE);
+		uintptr_t addr = (uintptr_t) &in->data[from];
+		uintptr_t base = addr - addr % page;
+		posix_madvise((void*) base, to - from + (addr - base),
+			POSIX_MADV_WILLNEED);
+	} else {
+		posix_fadvise(in->file->fd, in->start + from, to - from,
+			POSIX_FADV_WILLNEED);
+	}
+}
+
+// Whether the pages under [index, index+bytes) are in memory.
+static bool resident(input *in, long bytes) {
+	enum { MAX_PAGES = 32 };
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t addr = (uintptr_t) &in->data[in->index];
+	uintptr_t base = addr - addr % page;
+	size_t len = bytes + (addr - base);
+	if (len > (size_t) MAX_PAGES * page) len = (size_t) MAX_PAGES * page;
+	unsigned char vec[MAX_PAGES];
+	if (mincore((void*) base, len, vec) < 0) return true;
+	for (size_t p = 0; p < (len + page-1) / page; p++) {
+		if (!(vec[p] & 1)) return false;
+	}
+	return true;
+}
+
+long input_read(input *in, void *buf, long bytes) {
+	if (bytes > in->length - in->index) bytes = in->length - in->index;
+	if (bytes <= 0) return 0;
+	// Seeks while a decoder looks around the file are left alone.
+	if (in->index == in->next) read_ahead(in);
+	else in->ahead = in->index;
+	in->next = in->index + bytes;
+	bool sample = in->reads++ % SAMPLE_EVERY == 0;
+	if (in->data) {
+		if (sample) {
+			atomic_fetch_add(resident(in, bytes) ? &hits : &misses, 1);
+		}
+		memcpy(buf, &in->data[in->index], bytes);
+		in->index += bytes;
+		return bytes;
+	}
+	off_t at = in->start + in->index;
+#if defined(RWF_NOWAIT)
+	// Only succeeds in full if everything is in the page cache.
+	if (sample) {
+		struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+		ssize_t n = preadv2(in->file->fd, &iov, 1, at, RWF_NOWAIT);
+		if (n == bytes) {
+			atomic_fetch_add(&hits, 1);
+			in->index += n;
+			return n;
+		}
+		atomic_fetch_add(&misses, 1);
+	}
+#endif
+	// Positional reads leave the shared descriptor's offset alone.
+	for (;;) {
+		ssize_t n = pread(in->file->fd, buf, bytes, at);
+		if (n >= 0) {
+			in->index += n;
+			in->next = in->index;
+			return n;
+		}
+		if (errno != EINTR) return -1;
+	}
+}
+
+void input_prefetch(const char *filename, long start) {
+	if (readahead_bytes <= 0) return;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return;
+	// The page cache keeps what was read after the descriptor is gone.
+	posix_fadvise(fd, start, readahead_bytes, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+int input_seek(input *in, long offset, int whence) {
+	switch (whence) {
+	case SEEK_SET: break;
+	case SEEK_CUR: offset += in->index; break;
+	case SEEK_END: offset += in->length; break;
+	default: return -1;
+	}
+	if (offset < 0) offset = 0;
+	if (offset > in->length) offset = in->length;
+	in->index = offset;
+	return 0;
+}
+
+long input_tell(input *in) {
+	return in->index;
+}
+
+bool input_eof(input *in) {
+	return in->index >= in->length;
+}
@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include <pulse/pulseaudio.h>
+
+#include "latency.h"
+
+enum latency_profile latency_profile = latency_default;
+long latency_target_ms  = 0;
+long latency_request_ms = 0;
+
+// This many underruns this close together double tlength.
+#define GROW_AFTER  2
+#define GROW_WINDOW (30 * PA_USEC_PER_SEC)
+// After this long without one it is halved again, back to what
+// the profile asked for at the least.
+#define STABLE      (60 * PA_USEC_PER_SEC)
+
+static pa_usec_t started;
+static latency_stats stats;
+// tlength grown to after underruns, 0 while it has not been.
+static pa_usec_t grown;
+// What it was before it was first grown.
+static pa_usec_t base;
+static pa_usec_t changed;
+static pa_usec_t window_start;
+static int window_cnt;
+
+static const char *profile_names[] = {
+	[latency_default]     = "default",
+	[latency_interactive] = "interactive",
+	[latency_powersave]   = "powersave",
+};
+
+// In milliseconds; 0 for the server's default.
+static const struct {
+	long target;
+	long request;
+} profiles[] = {
+	[latency_default]     = {    0,    0 },
+	// Seeks and pauses are heard within a couple of sink periods.
+	[latency_interactive] = {   40,   10 },
+	// poppy and the sink are woken about once a second.
+	[latency_powersave]   = { 4000, 1000 },
+};
+
+int latency_profile_from_name(const char *name) {
+	int len = sizeof profile_names / sizeof *profile_names;
+	for (int i = 0; i < len; i++) {
+		if (!strcmp(profile_names[i], name)) return i;
+	}
+	return -1;
+}
+
+long latency_request(void) {
+	return latency_request_ms ? latency_request_ms
+		: profiles[latency_profile].request;
+}
+
+static uint32_t ms_to_bytes(long ms, const pa_sample_spec *spec) {
+	if (ms <= 0) return (uint32_t) -1;
+	return pa_usec_to_bytes(ms * PA_USEC_PER_MSEC, spec);
+}
+
+pa_buffer_attr *latency_buffer_attr(
+	pa_buffer_attr *attr,
+	const pa_sample_spec *spec
+) {
+	long target  = latency_target_ms  ? latency_target_ms
+		: profiles[latency_profile].target;
+	long request = latency_request();
+	if (!started) started = pa_rtclock_now();
+	if (grown) target = grown / PA_USEC_PER_MSEC;
+	if (!target && !request) return NULL;
+	*attr = (pa_buffer_attr) {
+		.maxlength = (uint32_t) -1,
+		.tlength   = ms_to_bytes(target, spec),
+		.prebuf    = (uint32_t) -1,
+		.minreq    = ms_to_bytes(request, spec),
+		.fragsize  = (uint32_t) -1,
+	};
+	return attr;
+}
+
+static void set_tlength(pa_stream *stream, pa_usec_t tlength) {
+	pa_buffer_attr attr = *pa_stream_get_buffer_attr(stream);
+	attr.tlength = pa_usec_to_bytes(tlength, pa_stream_get_sample_spec(stream));
+	// Left for the server to work out again from tlength.
+	attr.prebuf = (uint32_t) -1;
+	pa_operation *op = pa_stream_set_buffer_attr(stream, &attr, NULL, NULL);
+	if (op) pa_operation_unref(op);
+	grown = tlength > base ? tlength : 0;
+	changed = pa_rtclock_now();
+}
+
+void latency_underrun(pa_stream *stream) {
+	pa_usec_t now = pa_rtclock_now();
+	if (!stats.underruns) stats.first = (double) (now - started) / PA_USEC_PER_SEC;
+	stats.last = (double) (now - started) / PA_USEC_PER_SEC;
+	stats.underruns++;
+	changed = now;
+	if (now - window_start > GROW_WINDOW) {
+		window_start = now;
+		window_cnt = 0;
+	}
+	if (++window_cnt < GROW_AFTER) return;
+	window_cnt = 0;
+	const pa_buffer_attr *attr = pa_stream_get_buffer_attr(stream);
+	const pa_sample_spec *spec = pa_stream_get_sample_spec(stream);
+	if (!attr) return;
+	pa_usec_t tlength = pa_bytes_to_usec(attr->tlength, spec);
+	pa_usec_t max = pa_bytes_to_usec(attr->maxlength, spec);
+	if (!grown) base = tlength;
+	if (tlength >= max) return;
+	tlength *= 2;
+	if (tlength > max) tlength = max;
+	set_tlength(stream, tlength);
+}
+
+void latency_check(pa_stream *stream) {
+	if (!grown) return;
+	pa_usec_t now = pa_rtclock_now();
+	if (now - changed < STABLE) return;
+	pa_usec_t tlength = grown / 2;
+	if (tlength < base) tlength = base;
+	set_tlength(stream, tlength);
+}
+
+latency_stats latency_get_stats(void) {
+	latency_stats s = stats;
+	s.grown_ms = grown / PA_USEC_PER_MSEC;
+	return s;
+}
@@ -0,0 +1,288 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include <pulse/pulseaudio.h>
+
+#include "mix.h"
+#include "ch_map.h"
+
+// -3 dB, for splitting one channel across two speakers.
+static const float m3db = 0.70710678f;
+
+static int find(const pa_channel_map *map, pa_channel_position_t pos) {
+	for (int o = 0; o < map->channels; o++) {
+		if (map->map[o] == pos) return o;
+	}
+	return -1;
+}
+
+static bool add(
+	mix_matrix *mix,
+	const pa_channel_map *map,
+	int i,
+	pa_channel_position_t pos,
+	float gain
+) {
+	int o = find(map, pos);
+	if (o < 0) return false;
+	mix->coef[i][o] += gain;
+	return true;
+}
+
+static void place(
+	mix_matrix *mix,
+	const pa_channel_map *map,
+	int i,
+	pa_channel_position_t pos,
+	float gain
+) {
+	if (add(mix, map, i, pos, gain)) return;
+	switch (pos) {
+	case PA_CHANNEL_POSITION_MONO:
+		if (find(map, PA_CHANNEL_POSITION_FRONT_LEFT) >= 0 ||
+			find(map, PA_CHANNEL_POSITION_FRONT_RIGHT) >= 0) {
+			add(mix, map, i, PA_CHANNEL_POSITION_FRONT_LEFT, gain);
+			add(mix, map, i, PA_CHANNEL_POSITION_FRONT_RIGHT, gain);
+			return;
+		}
+		add(mix, map, i, PA_CHANNEL_POSITION_FRONT_CENTER, gain);
+		return;
+	case PA_CHANNEL_POSITION_FRONT_CENTER:
+		if (find(map, PA_CHANNEL_POSITION_FRONT_LEFT) >= 0 ||
+			find(map, PA_CHANNEL_POSITION_FRONT_RIGHT) >= 0) {
+			add(mix, map, i, PA_CHANNEL_POSITION_FRONT_LEFT, gain*m3db);
+			add(mix, map, i, PA_CHANNEL_POSITION_FRONT_RIGHT, gain*m3db);
+			return;
+		}
+		add(mix, map, i, PA_CHANNEL_POSITION_MONO, gain);
+		return;
+	case PA_CHANNEL_POSITION_FRONT_LEFT:
+	case PA_CHANNEL_POSITION_FRONT_RIGHT:
+		if (add(mix, map, i, PA_CHANNEL_POSITION_FRONT_CENTER, gain)) return;
+		add(mix, map, i, PA_CHANNEL_POSITION_MONO, gain);
+		return;
+	case PA_CHANNEL_POSITION_SIDE_LEFT:
+		if (add(mix, map, i, PA_CHANNEL_POSITION_REAR_LEFT, gain)) return;
+		place(mix, map, i, PA_CHANNEL_POSITION_FRONT_LEFT, gain*m3db);
+		return;
+	case PA_CHANNEL_POSITION_SIDE_RIGHT:
+		if (add(mix, map, i, PA_CHANNEL_POSITION_REAR_RIGHT, gain)) return;
+		place(mix, map, i, PA_CHANNEL_POSITION_FRONT_RIGHT, gain*m3db);
+		return;
+	case PA_CHANNEL_POSITION_REAR_LEFT:
+		if (add(mix, map, i, PA_CHANNEL_POSITION_SIDE_LEFT, gain)) return;
+		place(mix, map, i, PA_CHANNEL_POSITION_FRONT_LEFT, gain*m3db);
+		return;
+	case PA_CHANNEL_POSITION_REAR_RIGHT:
+		if (add(mix, map, i, PA_CHANNEL_POSITION_SIDE_RIGHT, gain)) return;
+		place(mix, map, i, PA_CHANNEL_POSITION_FRONT_RIGHT, gain*m3db);
+		return;
+	case PA_CHANNEL_POSITION_REAR_CENTER:
+		place(mix, map, i, PA_CHANNEL_POSITION_REAR_LEFT, gain*m3db);
+		place(mix, map, i, PA_CHANNEL_POSITION_REAR_RIGHT, gain*m3db);
+		return;
+	// Without a subwoofer the LFE channel is dropped.
+	default: return;
+	}
+}
+
+#if defined(__GNUC__)
+#define KERNEL static inline __attribute__((always_inline))
+#else
+#define KERNEL static inline
+#endif
+
+static void mix_copy(const mix_matrix *mix, float *out, const float *in, int frames) {
+	memmove(out, in, mix->in*frames * sizeof *out);
+}
+
+static void mix_gain(const mix_matrix *mix, float *out, const float *in, int frames) {
+	const int n = mix->in*frames;
+	int s = 0;
+#if defined(__SSE__)
+	const __m128 g = _mm_set1_ps(mix->gain);
+	for (; s+4 <= n; s += 4) {
+		_mm_storeu_ps(&out[s], _mm_mul_ps(_mm_loadu_ps(&in[s]), g));
+	}
+#endif
+	for (; s < n; s++) out[s] = in[s] * mix->gain;
+}
+
+// With ic a constant, each expansion below unrolls over the inputs.
+KERNEL void mix_any(
+	const mix_matrix *mix,
+	float *out, const float *in, int frames,
+	const int ic
+) {
+	const int oc = mix->out;
+	int f = 0;
+#if defined(__SSE__)
+	if (oc == 2) {
+		// Two stereo frames per vector.
+		for (; f+2 <= frames; f += 2) {
+			const float *x = &in[ic*f];
+			__m128 acc = _mm_setzero_ps();
+			for (int i = 0; i < ic; i++) {
+				__m128 c = _mm_load_ps(mix->coef[i]);
+				c = _mm_movelh_ps(c, c);
+				__m128 v = _mm_set_ps(x[ic+i], x[ic+i], x[i], x[i]);
+				acc = _mm_add_ps(acc, _mm_mul_ps(v, c));
+			}
+			_mm_storeu_ps(&out[2*f], acc);
+		}
+	} else {
+		for (; f < frames; f++) {
+			const float *x = &in[ic*f];
+			float *y = &out[oc*f];
+			for (int o = 0; o < oc; o += 4) {
+				__m128 acc = _mm_setzero_ps();
+				for (int i = 0; i < ic; i++) {
+					__m128 c = _mm_load_ps(&mix->coef[i][o]);
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(x[i]), c));
+				}
+				if (o+4 <= oc) {
+					_mm_storeu_ps(&y[o], acc);
+				} else {
+					float rest[4];
+					_mm_storeu_ps(rest, acc);
+					memcpy(&y[o], rest, (oc-o) * sizeof *y);
+				}
+			}
+		}
+	}
+#endif
+	for (; f < frames; f++) {
+		const float *x = &in[ic*f];
+		float *y = &out[oc*f];
+		for (int o = 0; o < oc; o++) {
+			float acc = 0;
+			for (int i = 0; i < ic; i++) acc += mix->coef[i][o] * x[i];
+			y[o] = acc;
+		}
+	}
+}
+
+#define MIX_N(n) \
+static void mix_##n(const mix_matrix *mix, float *out, const float *in, int frames) { \
+	mix_any(mix, out, in, frames, n); \
+}
+MIX_N(1) MIX_N(2) MIX_N(3) MIX_N(4) MIX_N(5) MIX_N(6) MIX_N(7) MIX_N(8)
+
+static mix_fn *const mix_n[MIX_MAX_IN+1] = {
+	NULL, mix_1, mix_2, mix_3, mix_4, mix_5, mix_6, mix_7, mix_8,
+};
+
+// Four mono frames widen to two vectors.
+static void mix_1_2(const mix_matrix *mix, float *out, const float *in, int frames) {
+	const float l = mix->coef[0][0], r = mix->coef[0][1];
+	int f = 0;
+#if defined(__SSE__)
+	const __m128 c = _mm_set_ps(r, l, r, l);
+	for (; f+4 <= frames; f += 4) {
+		__m128 x = _mm_loadu_ps(&in[f]);
+		_mm_storeu_ps(&out[2*f], _mm_mul_ps(_mm_unpacklo_ps(x, x), c));
+		_mm_storeu_ps(&out[2*f+4], _mm_mul_ps(_mm_unpackhi_ps(x, x), c));
+	}
+#endif
+	for (; f < frames; f++) {
+		out[2*f]   = l * in[f];
+		out[2*f+1] = r * in[f];
+	}
+}
+
+// Each output is its own input scaled, plus the other one scaled.
+static void mix_2_2(const mix_matrix *mix, float *out, const float *in, int frames) {
+	const float ll = mix->coef[0][0], lr = mix->coef[0][1];
+	const float rl = mix->coef[1][0], rr = mix->coef[1][1];
+	int f = 0;
+#if defined(__SSE__)
+	const __m128 straight = _mm_set_ps(rr, ll, rr, ll);
+	const __m128 cross    = _mm_set_ps(lr, rl, lr, rl);
+	for (; f+2 <= frames; f += 2) {
+		__m128 x = _mm_loadu_ps(&in[2*f]);
+		__m128 s = _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1));
+		__m128 y = _mm_add_ps(_mm_mul_ps(x, straight), _mm_mul_ps(s, cross));
+		_mm_storeu_ps(&out[2*f], y);
+	}
+#endif
+	for (; f < frames; f++) {
+		float l = in[2*f], r = in[2*f+1];
+		out[2*f]   = ll*l + rl*r;
+		out[2*f+1] = lr*l + rr*r;
+	}
+}
+
+static void mix_pick(mix_matrix *mix) {
+	mix->diagonal = mix->in == mix->out;
+	mix->gain = mix->coef[0][0];
+	for (int i = 0; i < mix->in && mix->diagonal; i++) {
+		for (int o = 0; o < mix->out; o++) {
+			if (mix->coef[i][o] != (i == o ? mix->gain : 0)) {
+				mix->diagonal = false;
+				break;
+			}
+		}
+	}
+	mix->identity = mix->diagonal && mix->gain == 1;
+	if (mix->identity) mix->kernel = mix_copy;
+	else if (mix->diagonal) mix->kernel = mix_gain;
+	else if (mix->in == 1 && mix->out == 2) mix->kernel = mix_1_2;
+	else if (mix->in == 2 && mix->out == 2) mix->kernel = mix_2_2;
+	else mix->kernel = mix_n[mix->in];
+}
+
+void mix_init(mix_matrix *mix, int channels, const pa_channel_map *map) {
+	*mix = (mix_matrix) {
+		.in  = channels,
+		.out = map->channels,
+	};
+	if (channels < 1 || channels > MIX_MAX_IN) return;
+	const pa_channel_map *in_map = &vorbis_pa_ch_map[channels];
+	for (int i = 0; i < channels; i++) {
+		place(mix, map, i, in_map->map[i], 1);
+	}
+	// Keep downmixes from clipping.
+	for (int o = 0; o < mix->out; o++) {
+		float sum = 0;
+		for (int i = 0; i < channels; i++) sum += fabsf(mix->coef[i][o]);
+		if (sum <= 1) continue;
+		for (int i = 0; i < channels; i++) mix->coef[i][o] /= sum;
+	}
+	mix_pick(mix);
+}
+
+void mix_scale(mix_matrix *mix, const mix_matrix *src, float scale) {
+	*mix = *src;
+	for (int i = 0; i < mix->in; i++) {
+		for (int o = 0; o < mix->out; o++) mix->coef[i][o] *= scale;
+	}
+	mix_pick(mix);
+}
+
+void mix_apply(const mix_matrix *mix, float *out, const float *in, int frames) {
+	mix->kernel(mix, out, in, frames);
+}
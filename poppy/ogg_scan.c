@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "track.h"
+#include "ogg_scan.h"
+
+enum {
+	OGG_HEADER   = 27,
+	OGG_BOS      = 0x02,
+	OGG_MAX_PAGE = OGG_HEADER + 255 + 255*255,
+	// Below this, walking page headers beats bisecting.
+	SCAN_WINDOW  = 1 << 16,
+};
+
+typedef struct ogg_hdr {
+	long pos;
+	long size;
+	int flags;
+	int64_t granule;
+	uint32_t serial;
+	uint32_t seq;
+} ogg_hdr;
+
+static uint32_t le32(const unsigned char *b) {
+	return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
+}
+
+static int64_t le64(const unsigned char *b) {
+	return (int64_t) ((uint64_t) le32(&b[4]) << 32 | le32(b));
+}
+
+// Reads the header of the page at pos, leaving its body alone.
+static bool hdr_at(int fd, long pos, long end, ogg_hdr *hdr) {
+	unsigned char b[OGG_HEADER + 255];
+	if (pos + OGG_HEADER > end) return false;
+	ssize_t n = pread(fd, b, sizeof b, pos);
+	if (n < OGG_HEADER) return false;
+	if (memcmp(b, "OggS", 4) || b[4] != 0) return false;
+	int segs = b[26];
+	if (n < OGG_HEADER + segs) return false;
+	long body = 0;
+	for (int s = 0; s < segs; s++) body += b[OGG_HEADER+s];
+	*hdr = (ogg_hdr) {
+		.pos    = pos,
+		.size   = OGG_HEADER + segs + body,
+		.flags   = b[5],
+		.granule = le64(&b[6]),
+		.serial  = le32(&b[14]),
+		.seq     = le32(&b[18]),
+	};
+	return pos + hdr->size <= end;
+}
+
+// Finds the first page starting in [pos, lim). A capture pattern only
+// counts if another page (or the end of the file) follows it.
+static bool sync_from(int fd, long pos, long lim, long end, ogg_hdr *hdr) {
+	unsigned char b[4096];
+	while (pos < lim) {
+		ssize_t n = pread(fd, b, sizeof b, pos);
+		if (n < 4) return false;
+		for (ssize_t i = 0; i+4 <= n && pos+i < lim; i++) {
+			if (memcmp(&b[i], "OggS", 4)) continue;
+			ogg_hdr next;
+			if (!hdr_at(fd, pos+i, end, hdr)) continue;
+			if (hdr->pos + hdr->size == end ||
+				hdr_at(fd, hdr->pos + hdr->size, end, &next)) {
+				return true;
+			}
+		}
+		pos += n - 3;
+	}
+	return false;
+}
+
+// Whether page b can come after page a in one logical stream.
+// A serial number may come back in a later link (say, a file chained
+// to itself), which bisecting on serials alone would take for this one.
+static bool follows(const ogg_hdr *a, const ogg_hdr *b) {
+	if (b->flags & OGG_BOS || b->seq <= a->seq) return false;
+	if (a->granule != -1 && b->granule != -1 &&
+		b->granule < a->granule) {
+		return false;
+	}
+	// Only so much fits in the pages from one to the other.
+	return b->pos - a->pos <= (long) (b->seq - a->seq) * OGG_MAX_PAGE;
+}
+
+// Reads as much of the first packet as it takes to tell the codec.
+static enum codec sniff(int fd, const ogg_hdr *hdr, bool *known) {
+	static const char magic_opus[]   = "OpusHead\x01";
+	static const char magic_vorbis[] = "\x01vorbis\0\0\0\0";
+	static const char magic_flac[]   = "\177FLAC\x01\0";
+	unsigned char b[OGG_HEADER + 255 + 16];
+	*known = false;
+	ssize_t n = pread(fd, b, sizeof b, hdr->pos);
+	if (n < OGG_HEADER) return OPUS;
+	const unsigned char *packet = &b[OGG_HEADER + b[26]];
+	if (packet - b > n) return OPUS;
+	size_t len = n - (packet - b);
+#define MAGIC(m) (len >= sizeof m - 1 && !memcmp(packet, m, sizeof m - 1))
+	*known = true;
+	if (MAGIC(magic_opus))   return OPUS;
+	if (MAGIC(magic_vorbis)) return VORBIS;
+	if (MAGIC(magic_flac))   return FLAC;
+#undef MAGIC
+	*known = false;
+	return OPUS;
+}
+
+int ogg_scan_links(const char *filename, ogg_link **links) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open: %s: ", filename);
+		perror("");
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	long end = st.st_size;
+	*links = NULL;
+	int cnt = 0;
+	long pos = 0;
+	while (pos < end) {
+		ogg_hdr first;
+		if (!hdr_at(fd, pos, end, &first)) {
+			if (cnt == 0) {
+				fprintf(stderr, "error parsing ogg stream: %s\n",
+					filename);
+				free(*links);
+				*links = NULL;
+				close(fd);
+				return -1;
+			}
+			// Trailing garbage belongs to the last link.
+			(*links)[cnt-1].end = end;
+			break;
+		}
+		ogg_link link = { .start = pos };
+		link.codec = sniff(fd, &first, &link.known);
+
+		// Narrow down where the serial number changes...
+		long lo = pos, hi = end;
+		ogg_hdr last = first;
+		while (hi - lo > SCAN_WINDOW) {
+			long mid = lo + (hi - lo) / 2;
+			ogg_hdr hdr;
+			if (!sync_from(fd, mid, hi, end, &hdr)) hi = mid;
+			else if (hdr.serial != first.serial) hi = hdr.pos;
+			else if (follows(&last, &hdr)) {
+				last = hdr;
+				lo = hdr.pos;
+			} else {
+				// Another link may lie in between,
+				// so walk every header from the start.
+				lo = pos;
+				break;
+			}
+		}
+		// ...then walk the headers up to the next run of BOS pages.
+		ogg_hdr hdr;
+		bool data = lo != first.pos;
+		pos = lo;
+		while (hdr_at(fd, pos, end, &hdr)) {
+			if (!(hdr.flags & OGG_BOS)) data = true;
+			else if (data) break;
+			pos += hdr.size;
+		}
+		link.end = pos;
+		ogg_link *grown = realloc(*links, (cnt+1) * sizeof *grown);
+		if (!grown) break;
+		*links = grown;
+		(*links)[cnt++] = link;
+	}
+	close(fd);
+	return cnt;
+}
@@ -25,66 +25,25 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "poppy.h"
 #include "track.h"
 #include "opus_track.h"
+#include "input.h"
 #include "def.h"
 #include "opus_error.h"
-#include "ch_map.h"
 
 int opus_read_callback (void *_stream, unsigned char *ptr, int nbytes) {
-	opus_stream *stream = _stream;
-	if (stream->index >= stream->length) {
-		return 0;
-	}
-	if (stream->index + nbytes > stream->length) {
-		nbytes = stream->length - stream->index;
-	}
-	for (;;) {
-		int n = fread(ptr, 1, nbytes, stream->file);
-		if (n > 0) {
-			stream->index += n;
-			return n;
-		}
-		if (feof(stream->file)) return 0;
-		if (ferror(stream->file)) return -1;
-	}
+	return input_read(_stream, ptr, nbytes);
 }
  
 int opus_seek_callback (void *_stream, opus_int64 offset, int whence) {
-	opus_stream *stream = _stream;
-	long real_offset;
-	long from_zero;
-	switch (whence) {
-	case SEEK_SET:
-		real_offset = offset - stream->index;
-		stream->index = offset;
-		break;
-	case SEEK_CUR:
-		real_offset = offset;
-		stream->index += offset;
-		break;
-	case SEEK_END:
-		from_zero = stream->length + offset;
-		real_offset = from_zero - stream->index;
-		stream->index = from_zero;
-		break;
-	}
-	if (real_offset < -stream->length) {
-		real_offset = -stream->length;
-		stream->index = 0;
-	} else if (real_offset > stream->length) {
-		real_offset = stream->length - stream->index;
-		stream->index = stream->length;
-	}
-	return fseek(stream->file, real_offset, SEEK_CUR);
+	return input_seek(_stream, offset, whence);
 }
  
 opus_int64 opus_tell_callback (void *_stream) {
-	opus_stream *stream = _stream;
-	return stream->index;
+	return input_tell(_stream);
 }
  
 int opus_close_callback (void *_stream) {
-	opus_stream *stream = _stream;
-	return fclose(stream->file);
+	input_close(_stream);
+	return 0;
 }
 
 OpusFileCallbacks opus_file_callbacks = {
@@ -124,13 +83,6 @@ retry:
 			return -1;
 		}
 	}
-	for (int os = ret-1; os >= 0; os--) {
-		float frame[9] = { 0 };
-		for (int ch = 0; ch < opus_chn; ch++) {
-			frame[vorbis_vorbis81_ch_map[opus_chn][ch]] = pcm[opus_chn*os+ch];
-		}
-		memcpy(&pcm[stream_channel_cnt*os], frame, sizeof frame);
-	}
 	ogg_int64_t pcm_tell = op_pcm_tell(track->file);
 	track->state.time = pcm_tell / 48e3;
 	return ret;
@@ -189,7 +141,7 @@ int opus_track_gain_type(track_i *this, enum gain_type gain_type) {
 	return op_set_gain_offset(
 		track->file,
 		opus_gain_type_table[gain_type],
-		track->state.gain
+		track->state.gain * 256
 	);
 }
 
@@ -241,42 +193,22 @@ int opus_track_from_file(
 	*track = (opus_track) { 0 };
 	track->track_i = opus_track_vtable;
 
-	if (link_start == 0 && link_end == -1) {
-		int operr;
-		track->file = op_open_file(filename, &operr);
-		if (operr != 0) {
-			fprintf(stderr,
-				"op_open_file: %s: %s\n",
-				filename, stropuserror(operr));
-			return -1;
-		}
+	if (input_open(&track->stream, filename, link_start, link_end) < 0) {
+		return -1;
 	}
-	else {
-		FILE *file = fopen(filename, "r");
-		if (!file) {
-			fprintf(stderr, "fopen: %s: ", filename);
-			perror("");
-			return -1;
-		}
-		fseek(file, link_start, SEEK_CUR);
-		track->stream = (opus_stream) {
-			.file   = file,
-			.index  = 0,
-			.length = link_end,
-		};
-		int operr;
-		track->file = op_open_callbacks(
-			&track->stream,
-			&opus_file_callbacks,
-			NULL, 0,
-			&operr
-		);
-		if (operr != 0) {
-			fprintf(stderr,
-				"op_open_callbacks: %s: %s\n",
-				filename, stropuserror(operr));
-			return -1;
-		}
+	int operr;
+	track->file = op_open_callbacks(
+		&track->stream,
+		&opus_file_callbacks,
+		NULL, 0,
+		&operr
+	);
+	if (operr != 0) {
+		fprintf(stderr,
+			"op_open_callbacks: %s: %s\n",
+			filename, stropuserror(operr));
+		input_close(&track->stream);
+		return -1;
 	}
 
 	track->meta.codec = OPUS;
@@ -284,6 +216,10 @@ int opus_track_from_file(
 	const OpusHead *head = op_head(track->file, -1);
 	track->meta.channels = head->channel_count;
 	track->meta.sample_rate = head->input_sample_rate;
+	// Opus always decodes at 48khz.
+	track->meta.dec_rate = 48000;
+	// libopusfile applies the gain while decoding.
+	track->state.scale = 1;
 
 	ogg_int64_t pcm_total = op_pcm_total(track->file, -1);
 	track->meta.length = pcm_total / 48e3;
@@ -17,6 +17,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <math.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -25,6 +27,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <string.h>
 
 #include <assert.h>
+#include <stdatomic.h>
 #include <threads.h>
 
 #include <unistd.h>
@@ -39,72 +42,453 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "opus_track.h"
 #include "vorbis_track.h"
 #include "flac_track.h"
-#include "ch_map.h"
+#include "ring.h"
+#include "mix.h"
+#include "resample.h"
+#include "latency.h"
+#include "probe.h"
+#include "cache.h"
+#include "input.h"
 
 #include "dbus.h"
+#include "ctl.h"
 
 const int stream_sample_rate = 48000;
-const int stream_channel_cnt = vorbis_8_1_surround;
+int stream_channel_cnt;
+bool native_rate;
+bool server_volume;
+// How many decoders may be open at once.
+int decoder_pool = 4;
 
-typedef struct stream_ud {
-	pa_mainloop_api *api;
-	struct player *player;
-} stream_ud;
+// The rate a track sampled at sample_rate should be decoded to.
+int output_rate(int sample_rate) {
+	if (!native_rate) return stream_sample_rate;
+	if (sample_rate <= 0 || sample_rate > PA_RATE_MAX) {
+		return stream_sample_rate;
+	}
+	return sample_rate;
+}
 
-void play(pa_stream *stream, size_t bytes, void *userdata) {
-	stream_ud *ud = userdata;
-	pa_mainloop_api *api = ud->api;
-	struct player *player = ud->player;
-	struct playlist *pl   = &player->pl;
-	track_i *track;
-	track_state state;
-	track_meta meta;
-	bool eot = false;
-cont:
-	while (bytes > 0) {
-		float *pcm;
-		size_t buf_bytes = bytes;
-		pa_stream_begin_write(stream, (void**) &pcm, &buf_bytes);
-		memset(pcm, 0, buf_bytes);
-		int s = buf_bytes / sizeof (float);
-		int spch = s / stream_channel_cnt;
-		int ts = 0;
-		do {
-			mtx_lock(&player->lock);
-			track_i *track = pl->track[pl->curr];
-			track->gain(track, player->gain, SEEK_SET);
-			track->gain_type(track, player->gain_type);
-			int sd = track->dec(track, pcm+stream_channel_cnt*ts, spch-ts);
-			mtx_unlock(&player->lock);
-			if (sd < 0) api->quit(api, 1);
-			if (sd == 0) eot = true;
-			ts += sd;
-		} while (ts < spch && !eot);
-		pa_stream_write(
-			stream,
-			pcm, buf_bytes,
-			NULL,
-			0, PA_SEEK_RELATIVE
-		);
-		bytes -= buf_bytes;
-		if (eot) break;
+// Frames decoded per lock of the player.
+const int decode_chunk = 1024;
+
+// How often the end of the playlist is looked at again
+// while it may still grow.
+const long probe_poll_ms = 20;
+
+// Never blocks the mainloop, only retries while it is publishing.
+now_playing player_snapshot(struct player *player) {
+	for (;;) {
+		unsigned seq = atomic_load_explicit(&player->now_seq,
+			memory_order_acquire);
+		if (seq & 1) {
+			thrd_yield();
+			continue;
+		}
+		now_playing now = player->now;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&player->now_seq,
+			memory_order_relaxed) == seq) {
+			return now;
+		}
 	}
-	mtx_lock(&player->lock);
-	track = pl->track[pl->curr];
-	state = track->state(track);
-	meta = track->meta(track);
-	if (state.time < meta.length && !eot) {
-		mtx_unlock(&player->lock);
+}
+
+pcm_mark player_now(struct player *player) {
+	return player_snapshot(player).mark;
+}
+
+float player_position(struct player *player) {
+	return player_snapshot(player).position;
+}
+
+// Must hold player->now_lock.
+static void publish(struct player *player, const now_playing *now) {
+	unsigned seq = atomic_load_explicit(&player->now_seq,
+		memory_order_relaxed);
+	atomic_store_explicit(&player->now_seq, seq+1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	player->now = *now;
+	atomic_store_explicit(&player->now_seq, seq+2, memory_order_release);
+}
+
+static void publish_mark(struct player *player, pcm_mark mark, double position) {
+	mtx_lock(&player->now_lock);
+	now_playing now = player->now;
+	if (!now.has_meta || now.mark.track != mark.track) {
+		now.has_meta = player_meta(player, mark.track, &now.meta);
+	}
+	now.mark = mark;
+	now.position = position;
+	publish(player, &now);
+	mtx_unlock(&player->now_lock);
+}
+
+static void publish_playing(struct player *player, bool playing) {
+	mtx_lock(&player->now_lock);
+	now_playing now = player->now;
+	now.playing = playing;
+	publish(player, &now);
+	mtx_unlock(&player->now_lock);
+}
+
+// Corks or uncorks the stream, once there is one.
+void player_cork(struct player *player, bool cork) {
+	if (!player->stream) return;
+	player->corks++;
+	pa_operation *op = pa_stream_cork(player->stream, cork, NULL, NULL);
+	if (op) pa_operation_unref(op);
+	publish_playing(player, !cork);
+}
+
+// Must be called on the mainloop.
+// Drops what the server still has queued from before the jump to gen,
+// so that it is heard as soon as it is written.
+static void flush_stale(struct player *player, unsigned gen) {
+	if (!player->stream || player->written_gen == gen) return;
+	player->written_gen = gen;
+	player->flushed = true;
+	pa_operation *op = pa_stream_flush(player->stream, NULL, NULL);
+	if (op) pa_operation_unref(op);
+}
+
+float player_buffer_fill(struct player *player) {
+	pcm_ring *ring = &player->ring;
+	if (ring->size == 0) return 0;
+	return (float) pcm_ring_fill(ring) / ring->size;
+}
+
+// Must hold player->lock.
+// With server_volume the sink input is turned down instead of the
+// samples, which also takes effect without waiting for the buffer.
+void player_set_volume(struct player *player, double volume) {
+	player->volume = volume;
+	if (!server_volume) {
+		player->gain = 20*log10(volume);
 		return;
 	}
-	track->seek(track, 0, SEEK_SET);
+	pa_stream *stream = player->stream;
+	if (!stream || pa_stream_get_state(stream) != PA_STREAM_READY) return;
+	pa_cvolume cvolume;
+	pa_cvolume_set(&cvolume, pa_stream_get_sample_spec(stream)->channels,
+		pa_sw_volume_from_linear(volume));
+	pa_operation *op = pa_context_set_sink_input_volume(
+		pa_stream_get_context(stream), pa_stream_get_index(stream),
+		&cvolume, NULL, NULL);
+	if (op) pa_operation_unref(op);
+	pa_mainloop_wakeup(player->loop);
+}
+
+// Must hold player->lock.
+// The track that plays after the current one, or -1 for none.
+static int next_track(struct player *player) {
+	struct playlist *pl = &player->pl;
+	switch (player->play_mode) {
+	case repeat_one: return pl->curr;
+	case single: return -1;
+	default: break;
+	}
+	int next = pl->curr + 1;
+	if (next >= pl->size) {
+		if (player->play_mode != repeat) return -1;
+		next = 0;
+	}
+	return next;
+}
+
+// Must hold player->lock.
+// Hands a newly opened decoder to the playlist. Once more than
+// decoder_pool are open, the one furthest from the current track,
+// either way round the playlist, is closed. The current track, the
+// one after it and the one being opened are never closed, so up to
+// decoder_pool+1 may stay open.
+static void player_keep(struct player *player, int track, track_i *new) {
+	struct playlist *pl = &player->pl;
+	track_desc_meta(&pl->desc[track], new);
+	new->gain(new, player->gain, SEEK_SET);
+	new->gain_type(new, player->gain_type);
+	pl->track[track] = new;
+	pl->open[pl->open_cnt++] = track;
+	int next = next_track(player);
+	while (pl->open_cnt > decoder_pool) {
+		int victim = -1, far = -1;
+		for (int i = 0; i < pl->open_cnt; i++) {
+			int t = pl->open[i];
+			if (t == track || t == pl->curr || t == next) continue;
+			int dist = (t - pl->curr + pl->size) % pl->size;
+			if (pl->size - dist < dist) dist = pl->size - dist;
+			if (dist > far) {
+				far = dist;
+				victim = i;
+			}
+		}
+		if (victim < 0) break;
+		int t = pl->open[victim];
+		track_close(pl->track[t]);
+		pl->track[t] = NULL;
+		pl->open[victim] = pl->open[--pl->open_cnt];
+	}
+}
+
+// Must hold player->lock.
+// Opens the decoder of a track on first use.
+track_i *player_track(struct player *player, int track) {
+	struct playlist *pl = &player->pl;
+	if (pl->track[track]) return pl->track[track];
+	track_desc *desc = &pl->desc[track];
+	if (desc->broken) return NULL;
+	track_i *new = track_open(desc);
+	if (!new) {
+		desc->broken = true;
+		return NULL;
+	}
+	player_keep(player, track, new);
+	return new;
+}
+
+// Puts an open track back at its start, unless it is there already.
+static void rewind_track(track_i *track) {
+	if (track && track->state(track).time != 0) {
+		track->seek(track, 0, SEEK_SET);
+	}
+}
+
+// What it takes for the next track to start without delay.
+typedef struct preroll {
+	// -1 for nothing.
+	int track;
+	// What to open it from, when it is not open yet.
+	track_desc desc;
+	// Otherwise, the decoder to rewind.
+	track_i *rewind;
+} preroll;
+
+// Must hold player->lock.
+static preroll preroll_plan(struct player *player) {
+	struct playlist *pl = &player->pl;
+	preroll pre = { .track = next_track(player) };
+	if (pre.track < 0 || pre.track == pl->curr) {
+		pre.track = -1;
+		return pre;
+	}
+	const track_desc *desc = &pl->desc[pre.track];
+	pre.rewind = pl->track[pre.track];
+	if (pre.rewind || desc->broken) {
+		if (!pre.rewind) pre.track = -1;
+		return pre;
+	}
+	pre.desc = (track_desc) {
+		.filename   = desc->filename,
+		.codec      = desc->codec,
+		.isogg      = desc->isogg,
+		.link_start = desc->link_start,
+		.link_end   = desc->link_end,
+	};
+	return pre;
+}
+
+// Only on the decode thread, without player->lock.
+// Opening a decoder means reading and parsing headers, which is done
+// here, between chunks, instead of at the boundary with the lock held.
+// Decoders are only ever used by the decode thread,
+// so one that is open can be rewound here too.
+static void preroll_run(struct player *player, const preroll *pre) {
+	if (pre->track < 0) return;
+	if (pre->rewind) {
+		rewind_track(pre->rewind);
+		return;
+	}
+	track_i *track = track_open(&pre->desc);
+	struct playlist *pl = &player->pl;
+	mtx_lock(&player->lock);
+	if (pl->track[pre->track]) {
+		if (track) track_close(track);
+	} else if (!track) {
+		pl->desc[pre->track].broken = true;
+	} else {
+		player_keep(player, pre->track, track);
+	}
+	mtx_unlock(&player->lock);
+}
+
+// Adds tracks to the end of the playlist, which may be playing.
+void player_append(struct player *player, const track_desc *descs, int n) {
+	struct playlist *pl = &player->pl;
+	mtx_lock(&player->lock);
+	mtx_lock(&pl->lock);
+	track_desc *desc = realloc(pl->desc, (pl->size+n) * sizeof *desc);
+	if (desc) pl->desc = desc;
+	track_i **track = realloc(pl->track, (pl->size+n) * sizeof *track);
+	if (track) pl->track = track;
+	if (desc && track) {
+		memcpy(&pl->desc[pl->size], descs, n * sizeof *descs);
+		memset(&pl->track[pl->size], 0, n * sizeof *track);
+		pl->size += n;
+	}
+	mtx_unlock(&pl->lock);
+	mtx_unlock(&player->lock);
+}
+
+// Metadata is kept with the playlist, so it is there
+// even after the decoder has been closed.
+bool player_meta(struct player *player, int track, track_meta *meta) {
+	struct playlist *pl = &player->pl;
+	mtx_lock(&pl->lock);
+	track_desc *desc = &pl->desc[track];
+	bool known = atomic_load(&desc->has_meta);
+	if (known) *meta = desc->meta;
+	mtx_unlock(&pl->lock);
+	return known;
+}
+
+// Must hold player->lock.
+// Starts reading in the start of the track that follows the current one,
+// so that opening it does not wait on the disk.
+static void prefetch_next(struct player *player) {
+	struct playlist *pl = &player->pl;
+	int next = next_track(player);
+	if (next < 0 || next == pl->curr) return;
+	const track_desc *desc = &pl->desc[next];
+	if (pl->track[next] || desc->broken) return;
+	input_prefetch(desc->filename, desc->link_start);
+}
+
+// Must hold player->lock.
+// Everything already decoded is dropped by play().
+void player_jump(struct player *player, int track, float time) {
+	struct playlist *pl = &player->pl;
+	track_i *old = pl->track[pl->curr];
+	if (old && pl->curr != track) old->seek(old, 0, SEEK_SET);
+	pl->curr = track;
+	track_i *new = player_track(player, track);
+	if (new) new->seek(new, time, SEEK_SET);
+	prefetch_next(player);
+	unsigned gen = atomic_fetch_add(&player->gen, 1) + 1;
+	pcm_mark now = {
+		.gen   = gen,
+		.track = track,
+		.time  = new ? new->state(new).time : 0,
+	};
+	publish_mark(player, now, now.time);
+	pcm_ring_wake(&player->ring);
+}
+
+// Must be called on the mainloop.
+// Posts a command for the decode thread,
+// which carries it out between chunks.
+void player_command(struct player *player, cmd *cmd) {
+	// Relative seeks are taken from it.
+	player_update_position(player);
+	cmd->corks = player->corks;
+	cmd_push(&player->cmds, cmd);
+	pcm_ring_wake(&player->ring);
+}
+
+// Moves dir tracks on in play order, from the start of the track.
+static void step(struct player *player, int dir, int *track, bool *stop) {
+	int size = player->pl.size;
+	switch (player->play_mode) {
+	case playlist:
+	case single:
+		*track += dir;
+		if (*track < 0 || *track >= size) {
+			*track = 0;
+			*stop = true;
+		}
+		break;
+	case repeat:
+		*track = (*track + dir + size) % size;
+		break;
+	case repeat_one: break;
+	}
+}
+
+// Folds every queued command into a single jump, so that a burst of
+// seeks, say, only seeks the decoder once.
+static void run_commands(struct player *player) {
+	cmd *batch = cmd_take(&player->cmds);
+	if (!batch) return;
+	now_playing now = player_snapshot(player);
+	int track = now.mark.track;
+	double time = now.position;
+	bool stop = false;
+	mtx_lock(&player->lock);
+	for (cmd *c = batch; c; c = c->next) {
+		switch (c->type) {
+		case CMD_NEXT:
+		case CMD_PREVIOUS:
+			step(player, c->type == CMD_NEXT ? 1 : -1, &track, &stop);
+			time = 0;
+			break;
+		case CMD_SEEK:
+			time += c->time;
+			if (time < 0) time = 0;
+			break;
+		case CMD_SET_POSITION:
+			if (c->track == track) time = c->time;
+			break;
+		case CMD_STOP:
+			track = 0;
+			time = 0;
+			stop = true;
+			break;
+		}
+	}
+	player_jump(player, track, time);
+	mtx_unlock(&player->lock);
+	now_playing done = player_snapshot(player);
+	for (cmd *c = batch, *next; c; c = next) {
+		next = c->next;
+		c->done_track = done.mark.track;
+		c->done_time  = done.position;
+		c->changed    = done.mark.track != now.mark.track;
+		c->stopped    = stop;
+		c->last       = !next;
+		cmd_push(&player->acks, c);
+	}
+	pa_mainloop_wakeup(player->loop);
+}
+
+// Must be called on the mainloop.
+void player_acks(struct player *player) {
+	cmd *acks = cmd_take(&player->acks);
+	if (acks) flush_stale(player, atomic_load(&player->gen));
+	for (cmd *c = acks, *next; c; c = next) {
+		next = c->next;
+		// Unless playback was resumed since, e.g. by Play after Stop.
+		if (c->last && c->stopped && c->corks == player->corks) {
+			player_cork(player, true);
+		}
+		if (c->last && player->conn) signal_commanded(player->conn, c);
+		if (c->ack) c->ack(player, c);
+		free(c);
+	}
+}
+
+enum track_end {
+	end_next,
+	end_cork,
+	// The playlist may still grow, so the track is left where it
+	// ended and its end is looked at again later.
+	end_wait,
+};
+
+// Moves on from a track that is played out.
+static enum track_end end_of_track(struct player *player) {
+	struct playlist *pl = &player->pl;
+	bool moves_on = player->play_mode == playlist ||
+		player->play_mode == repeat;
+	if (moves_on && pl->curr + 1 >= pl->size &&
+		atomic_load(&player->probing)) {
+		return end_wait;
+	}
+	enum track_end end = end_next;
 	switch (player->play_mode) {
 	case playlist:
 		pl->curr++;
 		if (pl->curr >= pl->size) {
 			pl->curr = 0;
-			pa_operation *op = pa_stream_cork(stream, 1, NULL, NULL);
-			pa_operation_unref(op);
+			end = end_cork;
 		}
 		break;
 	case repeat:
@@ -112,20 +496,428 @@ cont:
 		pl->curr %= pl->size;
 		break;
 	case repeat_one: break;
-	case single: {
-		pa_operation *op = pa_stream_cork(stream, 1, NULL, NULL);
-		pa_operation_unref(op);
+	case single: end = end_cork; break;
+	}
+	// Normally preroll_run() has opened or rewound it already,
+	// unless it is the track that just ended.
+	rewind_track(pl->track[pl->curr]);
+	prefetch_next(player);
+	return end;
+}
+
+int decode_main(void *_player) {
+	struct player *player = _player;
+	struct playlist *pl   = &player->pl;
+	pcm_ring *ring = &player->ring;
+	const size_t chunk = decode_chunk * stream_channel_cnt;
+	// Gain last pushed to a track, and the matrix that applies it.
+	track_i *gained = NULL;
+	double gain = 0;
+	enum gain_type gain_type = 0;
+	const mix_matrix *gain_src = NULL;
+	float gain_scale = 1;
+	mix_matrix gain_mix;
+	// Tracks in a row that could not be opened.
+	int failures = 0;
+	for (;;) {
+		pcm_ring_wait(ring, chunk);
+		run_commands(player);
+		// The ring is written to under the lock,
+		// which the mainloop holds while it grows it.
+		mtx_lock(&player->lock);
+		size_t space;
+		float *pcm = pcm_ring_write_ptr(ring, &space);
+		if (space > chunk) space = chunk;
+		int spch = space / stream_channel_cnt;
+		if (spch == 0) {
+			mtx_unlock(&player->lock);
+			continue;
+		}
+		// A track that ends inside the chunk is followed straight away
+		// by the next one, so the two are spliced without a gap.
+		pcm_mark marks[PCM_MARKS_PER_CHUNK];
+		int mark_cnt = 0;
+		int done = 0;
+		enum track_end end = end_next;
+		bool stalled = false;
+		size_t head = atomic_load(&ring->head);
+		unsigned gen = atomic_load(&player->gen);
+		for (int seg = 0; seg < PCM_MARKS_PER_CHUNK-1 && done < spch; seg++) {
+			track_i *track = player_track(player, pl->curr);
+			if (!track) {
+				// After a whole pass of failures, nothing would
+				// ever play, so stop instead of spinning.
+				if (++failures >= pl->size &&
+					!atomic_load(&player->probing)) {
+					end = end_cork;
+					stalled = true;
+					break;
+				}
+				end = end_of_track(player);
+				if (end != end_next) break;
+				continue;
+			}
+			failures = 0;
+			track_meta meta = track->meta(track);
+			int chn = meta.channels;
+			bool eot = chn < 1 || chn > MIX_MAX_IN;
+			if (track != gained || player->gain != gain ||
+				player->gain_type != gain_type) {
+				gained = track;
+				gain = player->gain;
+				gain_type = player->gain_type;
+				track->gain(track, gain, SEEK_SET);
+				track->gain_type(track, gain_type);
+			}
+			const mix_matrix *mix = &player->mix[eot ? 0 : chn];
+			float scale = track->state(track).scale;
+			if (!eot && scale != 1) {
+				if (gain_src != mix || gain_scale != scale) {
+					gain_src = mix;
+					gain_scale = scale;
+					mix_scale(&gain_mix, mix, scale);
+				}
+				mix = &gain_mix;
+			}
+			float *dst = &pcm[done*stream_channel_cnt];
+			float *out = mix->diagonal ? dst : player->scratch;
+			pcm_mark mark = {
+				.at    = head + done*stream_channel_cnt,
+				.gen   = gen,
+				.track = pl->curr,
+				.time  = track->state(track).time,
+				.rate  = meta.dec_rate,
+			};
+			int ts = 0;
+			while (ts < spch-done && !eot) {
+				int sd = track->dec(track, out+chn*ts, spch-done-ts);
+				if (sd < 0) {
+					mtx_unlock(&player->lock);
+					atomic_store(&player->failed, true);
+					pa_mainloop_wakeup(player->loop);
+					return -1;
+				}
+				if (sd == 0) eot = true;
+				ts += sd;
+			}
+			if (ts > 0) {
+				if (!mix->identity) mix_apply(mix, dst, out, ts);
+				marks[mark_cnt++] = mark;
+				done += ts;
+			}
+			if (!eot) break;
+			end = end_of_track(player);
+			if (end != end_next) break;
+		}
+		for (int m = 0; m < mark_cnt; m++) {
+			pcm_ring_push_mark(ring, &marks[m]);
+		}
+		pcm_ring_commit(ring, done*stream_channel_cnt);
+		if (end == end_cork) {
+			pcm_mark cork_mark = {
+				.at    = head + done*stream_channel_cnt,
+				.gen   = gen,
+				.flags = PCM_MARK_CORK,
+			};
+			pcm_ring_push_mark(ring, &cork_mark);
+		}
+		preroll pre = preroll_plan(player);
+		mtx_unlock(&player->lock);
+		preroll_run(player, &pre);
+		if (atomic_load(&player->starved)) {
+			pa_mainloop_wakeup(player->loop);
+		}
+		// Commands still wake it straight away.
+		if (end == end_wait) pcm_ring_idle(ring, probe_poll_ms);
+		if (stalled) {
+			pcm_ring_idle(ring, -1);
+			failures = 0;
+		}
+	}
+}
+
+// Copies decoded samples out of the ring,
+// skipping any that were decoded before the last jump.
+// Stops short of audio at a rate other than the stream's,
+// leaving that rate in *rate.
+static size_t take(
+	struct player *player,
+	float *pcm, size_t samples,
+	bool *cork, int *rate
+) {
+	pcm_ring *ring = &player->ring;
+	pcm_mark *cursor = &player->cursor;
+	unsigned gen = atomic_load(&player->gen);
+	size_t ts = 0;
+	while (ts < samples) {
+		size_t tail = atomic_load(&ring->tail);
+		pcm_mark mark;
+		while (pcm_ring_peek_mark(ring, &mark) && mark.at <= tail) {
+			if (mark.gen == gen && !(mark.flags & PCM_MARK_CORK) &&
+				mark.rate != player->rate) {
+				*rate = mark.rate;
+				return ts;
+			}
+			pcm_ring_pop_mark(ring);
+			if (mark.flags & PCM_MARK_CORK) {
+				if (mark.gen != gen) continue;
+				*cork = true;
+				return ts;
+			}
+			if (mark.gen != cursor->gen || mark.track != cursor->track ||
+				mark.time < cursor->time) {
+				player->cursor_origin = mark.time;
+			}
+			*cursor = mark;
+		}
+		size_t avail;
+		const float *src = pcm_ring_read_ptr(ring, &avail);
+		if (avail == 0) break;
+		if (pcm_ring_peek_mark(ring, &mark) && mark.at - tail < avail) {
+			avail = mark.at - tail;
+		}
+		if (cursor->gen != gen) {
+			pcm_ring_consume(ring, avail);
+			continue;
+		}
+		if (avail > samples - ts) avail = samples - ts;
+		memcpy(&pcm[ts], src, avail * sizeof *pcm);
+		pcm_ring_consume(ring, avail);
+		ts += avail;
 	}
+	return ts;
+}
+
+static pa_stream *stream_new(
+	pa_context *ctx,
+	const pa_channel_map *map,
+	struct player *player,
+	bool corked
+);
+
+// Enough is decoded ahead to answer each request from the server
+// in one go, so that neither thread is woken more than it has to be.
+static size_t buffer_frames(struct player *player, int rate) {
+	long buffer_ms = player->buffer_ms;
+	if (buffer_ms < latency_request()) buffer_ms = latency_request();
+	size_t frames = buffer_ms * rate / 1000;
+	if (frames < decode_chunk) frames = decode_chunk;
+	return frames;
+}
+
+// The old stream has played out, so the next track can start
+// on a stream at its own rate.
+static void stream_drained(pa_stream *old, int success, void *userdata) {
+	struct player *player = userdata;
+	pa_context *ctx = pa_stream_get_context(old);
+	pa_channel_map map = *pa_stream_get_channel_map(old);
+	pa_stream_set_write_callback(old, NULL, NULL);
+	// The ring is grown, never shrunk, to hold as long at the new rate.
+	// Nothing reads from it until the new stream asks for more.
+	size_t frames = buffer_frames(player, player->rate);
+	mtx_lock(&player->lock);
+	if (pcm_ring_grow(&player->ring, frames * stream_channel_cnt,
+		2 * frames / decode_chunk + 16) < 0) {
+		fprintf(stderr, "unable to grow decode buffer\n");
 	}
 	mtx_unlock(&player->lock);
-	if (bytes > 0) goto cont;
+	pa_stream *stream = stream_new(ctx, &map, player,
+		pa_stream_is_corked(old));
+	mtx_lock(&player->lock);
+	player->stream = stream;
+	mtx_unlock(&player->lock);
+	player->reopening = false;
+	pa_stream_disconnect(old);
+	pa_stream_unref(old);
+}
+
+static void stream_underflow(pa_stream *stream, void *userdata) {
+	struct player *player = userdata;
+	// Draining for a new rate runs the stream dry on purpose,
+	// and so may flushing for a jump.
+	if (player->reopening || player->flushed) return;
+	latency_underrun(stream);
+}
+
+// Publishes what is being heard: what has been written,
+// less what the server has yet to play of it.
+// Nothing is published until the stream has timing for what was
+// written since the last jump, which was published as it was made.
+static void publish_position(struct player *player) {
+	pcm_mark cursor = player->cursor;
+	if (cursor.gen != atomic_load(&player->gen)) return;
+	pa_usec_t latency;
+	int negative;
+	if (pa_stream_get_latency(player->stream, &latency, &negative) < 0) {
+		return;
+	}
+	size_t played = atomic_load(&player->ring.tail) - cursor.at;
+	double position =
+		cursor.time + (double) played / stream_channel_cnt / cursor.rate;
+	if (!negative) position -= (double) latency / PA_USEC_PER_SEC;
+	// Still hearing the track before, or what was flushed for the jump.
+	if (position < player->cursor_origin) position = player->cursor_origin;
+	publish_mark(player, cursor, position);
+}
+
+// Must be called on the mainloop.
+// Between writes, which may be a second or more apart, position is
+// only moved on when someone is about to look at it.
+void player_update_position(struct player *player) {
+	if (player->stream) publish_position(player);
+}
+
+void play(pa_stream *stream, size_t bytes, void *userdata) {
+	struct player *player = userdata;
+	pcm_ring *ring = &player->ring;
+	if (player->reopening) return;
+	// The server asks for more only after it has seen the flush,
+	// along with any underflow that came of it.
+	player->flushed = false;
+	bool cork = false;
+	int rate = 0;
+retry:
+	while (bytes > 0 && !cork && !rate && pcm_ring_fill(ring) > 0) {
+		float *pcm;
+		size_t buf_bytes = bytes;
+		pa_stream_begin_write(stream, (void**) &pcm, &buf_bytes);
+		size_t s = buf_bytes / sizeof (float);
+		s -= s % stream_channel_cnt;
+		if (s == 0) {
+			pa_stream_cancel_write(stream);
+			break;
+		}
+		s = take(player, pcm, s, &cork, &rate);
+		if (s == 0) {
+			pa_stream_cancel_write(stream);
+			continue;
+		}
+		// In case the jump came in after the last acknowledgement.
+		flush_stale(player, player->cursor.gen);
+		pa_stream_write(
+			stream,
+			pcm, s * sizeof (float),
+			NULL,
+			0, PA_SEEK_RELATIVE
+		);
+		bytes -= s * sizeof (float);
+	}
+	if (cork) {
+		player_cork(player, true);
+	} else if (rate) {
+		player->rate = rate;
+		player->reopening = true;
+		pa_operation *op = pa_stream_drain(stream,
+			stream_drained, player);
+		pa_operation_unref(op);
+	} else if (bytes > 0) {
+		atomic_store(&player->starved, true);
+		if (pcm_ring_fill(ring) > 0) {
+			atomic_store(&player->starved, false);
+			goto retry;
+		}
+	}
+	latency_check(stream);
+	publish_position(player);
 }
 
 typedef struct ctx_ud {
 	pa_mainloop_api *api;
 	struct player *player;
+	pa_channel_map map;
 } ctx_ud;
 
+// Decodes straight into the layout of the sink, so nothing is
+// sent to the server that it would only have to remix.
+static int start_playback(pa_context *ctx, ctx_ud *ud) {
+	struct player *player = ud->player;
+	pa_channel_map *map = &ud->map;
+	if (!pa_channel_map_valid(map)) pa_channel_map_init_stereo(map);
+	stream_channel_cnt = map->channels;
+	for (int chn = 1; chn <= MIX_MAX_IN; chn++) {
+		mix_init(&player->mix[chn], chn, map);
+	}
+
+	mtx_lock(&player->lock);
+	track_i *track = player_track(player, player->pl.curr);
+	player->rate = track ? track->meta(track).dec_rate : stream_sample_rate;
+	mtx_unlock(&player->lock);
+
+	// Sized for the first track's rate, and grown if a later one
+	// reopens the stream at a higher rate.
+	size_t frames = buffer_frames(player, player->rate);
+	player->scratch = calloc(decode_chunk * MIX_MAX_IN,
+		sizeof *player->scratch);
+	int ret = pcm_ring_init(&player->ring,
+		frames * stream_channel_cnt,
+		2 * frames / decode_chunk + 16);
+	if (!player->scratch || ret < 0) {
+		fprintf(stderr, "unable to allocate decode buffer\n");
+		return -1;
+	}
+
+	thrd_t decoder;
+	ret = thrd_create(&decoder, decode_main, player);
+	if (ret != thrd_success) {
+		fprintf(stderr, "unable to start decode thread\n");
+		return -1;
+	}
+	thrd_detach(decoder);
+
+	player->stream = stream_new(ctx, map, player, false);
+	publish_playing(player, true);
+	return 0;
+}
+
+static pa_stream *stream_new(
+	pa_context *ctx,
+	const pa_channel_map *map,
+	struct player *player,
+	bool corked
+) {
+	pa_sample_spec spec = (pa_sample_spec) {
+		.format   = PA_SAMPLE_FLOAT32LE,
+		.rate     = player->rate,
+		.channels = map->channels,
+	};
+	assert(pa_sample_spec_valid(&spec));
+	pa_stream *stream = pa_stream_new(ctx, "Poppy", &spec, map);
+	assert(stream != NULL);
+	pa_stream_set_write_callback(stream, play, player);
+	pa_stream_set_underflow_callback(stream, stream_underflow, player);
+	pa_stream_flags_t flags =
+		PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+	if (corked) flags |= PA_STREAM_START_CORKED;
+	// What is asked for is the latency through to the sink,
+	// which is adjusted to suit.
+	pa_buffer_attr attr;
+	const pa_buffer_attr *buffer = latency_buffer_attr(&attr, &spec);
+	if (buffer) flags |= PA_STREAM_ADJUST_LATENCY;
+	pa_cvolume cvolume, *volume = NULL;
+	if (server_volume) {
+		volume = pa_cvolume_set(&cvolume, spec.channels,
+			pa_sw_volume_from_linear(player->volume));
+	}
+	assert(pa_stream_connect_playback(stream,
+		NULL, buffer, flags, volume, NULL) == 0);
+	return stream;
+}
+
+void sink_info_cb(
+	pa_context *ctx,
+	const pa_sink_info *info,
+	int eol,
+	void *userdata
+) {
+	ctx_ud *ud = userdata;
+	if (info) {
+		ud->map = info->channel_map;
+		return;
+	}
+	if (ud->player->stream) return;
+	if (start_playback(ctx, ud) < 0) ud->api->quit(ud->api, 1);
+}
+
 void ctx_state_cb(pa_context *ctx, void *userdata) {
 	ctx_ud *ud = userdata;
 	pa_mainloop_api *api = ud->api;
@@ -136,78 +928,206 @@ void ctx_state_cb(pa_context *ctx, void *userdata) {
 		return;
 	case PA_CONTEXT_READY: {
 		//puts("pa_context ready");
-		pa_sample_spec spec = (pa_sample_spec) {
-			.format   = PA_SAMPLE_FLOAT32LE,
-			.rate     = stream_sample_rate,
-			.channels = stream_channel_cnt,
-		};
-		assert(pa_sample_spec_valid(&spec));
-		pa_stream *stream = pa_stream_new(
-			ctx, "Poppy", &spec, &vorbis_pa_ch_map[stream_channel_cnt]);
-		assert(stream != NULL);
-		stream_ud *sud = calloc(1, sizeof *sud);
-		sud->api    = api;
-		sud->player = ud->player;
-		sud->player->stream = stream;
-		pa_stream_set_write_callback(stream, play, sud);
-		assert(pa_stream_connect_playback(stream, NULL, NULL, 0, NULL, NULL) == 0);
+		pa_operation *op = pa_context_get_sink_info_by_name(
+			ctx, "@DEFAULT_SINK@", sink_info_cb, ud);
+		pa_operation_unref(op);
 		return;
 	}
 	case PA_CONTEXT_TERMINATED: puts("pa_context terminated"); break;
 	case PA_CONTEXT_FAILED:     puts("pa_context failed"); break;
 	default: break;
     }
-	pa_stream_unref(ud->player->stream);
+	if (ud->player->stream) pa_stream_unref(ud->player->stream);
 	free(ud);
 	api->quit(api, 0);
 }
 
-// void print_help(const char *cmd) {
-// 	fprintf(stderr, "%s [-h|-g|-a|-t|-b] <oggopus>+\n\n", cmd);
-// 	fprintf(stderr, "\t-h\tprint this message\n");
-// 	fprintf(stderr, "\t-g#\tset gain to # dB\n");
-// 	fprintf(stderr, "\t-a\tadd album gain\n");
-// 	fprintf(stderr, "\t-t\tadd track gain\n");
-// 	fprintf(stderr, "\t-b\tremove default gain\n");
-// }
-
-// void parse_opt(const char *arg) {
-// 	int len = strlen(arg);
-// 	if (len < 2) return;
-// 	switch (arg[1]) {
-// 	default:
-// 	case 'h': print_help("poppy"); exit(0);
-// 	case 'g': gain = 256*strtof(&arg[2], NULL); break;
-// 	case 'a': gain_type = OP_ALBUM_GAIN; break;
-// 	case 't': gain_type = OP_TRACK_GAIN; break;
-// 	case 'b': gain_type = OP_ABSOLUTE_GAIN; break;
-// 	}
-// }
+typedef struct status_ud {
+	struct player *player;
+	pa_usec_t period;
+	// What the line shows, empty once something else was printed.
+	char shown[256];
+} status_ud;
+
+static void status_render(char *line, size_t size, struct player *player) {
+	now_playing now = player_snapshot(player);
+	const track_meta *meta = &now.meta;
+	char number[64] = "";
+	if (meta->tracknumber) {
+		snprintf(number, sizeof number, "%s%s%s ",
+			meta->tracknumber,
+			meta->tracktotal ? "/" : "",
+			meta->tracktotal ? meta->tracktotal : "");
+	}
+	double position = now.position;
+	double remaining = meta->length - position;
+	double pmin, lmin, rmin;
+	double psec = modf(position/60, &pmin)*60;
+	double lsec = modf(meta->length/60, &lmin)*60;
+	double rsec = modf(remaining/60, &rmin)*60;
+	snprintf(line, size,
+		"%s[%02.0f:%05.2f/%02.0f:%05.2f/%02.0f:%05.2f] [buf %3.0f%%]",
+		number,
+		pmin, psec, lmin, lsec, rmin, rsec,
+		100 * player_buffer_fill(player)
+	);
+}
+
+// Redraws the status line, if it would look any different.
+static void status_cb(
+	pa_mainloop_api *api,
+	pa_time_event *event,
+	const struct timeval *_tv,
+	void *userdata
+) {
+	status_ud *status = userdata;
+	struct player *player = status->player;
+	player_update_position(player);
+	if (player_snapshot(player).has_meta) {
+		char line[sizeof status->shown];
+		status_render(line, sizeof line, player);
+		if (strcmp(line, status->shown)) {
+			// Padded to cover whatever was longer before.
+			printf("\r%-*s", (int) strlen(status->shown), line);
+			fflush(stdout);
+			strcpy(status->shown, line);
+		}
+	}
+	struct timeval tv;
+	api->time_restart(event,
+		pa_timeval_rtstore(&tv, pa_rtclock_now() + status->period, true));
+}
+
+void print_help(const char *cmd) {
+	fprintf(stderr, "%s [-h] [-n] [-s] [-b <ms>] [-j <n>] [-p <n>] [-a <KiB>] [-q <quality>] [-r <resampler>] [-l <profile>] [-t <ms>] [-m <ms>] [-u <hz>] <file>+\n\n", cmd);
+	fprintf(stderr, "\t-h\tprint this message\n");
+	fprintf(stderr, "\t-n\tplay at each track's own sample rate\n");
+	fprintf(stderr, "\t-s\tset volume on the server instead of scaling samples\n");
+	fprintf(stderr, "\t-p<n>\tkeep at most <n> decoders open (default: 4)\n");
+	fprintf(stderr, "\t-j<n>\tprobe files on <n> threads (default: 4)\n");
+	fprintf(stderr, "\t-a<KiB>\tread <KiB> ahead of the decoders, 0 to not (default: 2048)\n");
+	fprintf(stderr, "\t-q<quality>\tresample quality: fast, default or best\n");
+	fprintf(stderr, "\t-r<resampler>\tresampler: speex (default) or swr\n");
+	fprintf(stderr, "\t-b<ms>\tdecode ahead <ms> milliseconds (default: 500)\n");
+	fprintf(stderr, "\t-l<profile>\tlatency: default, interactive or powersave\n");
+	fprintf(stderr, "\t-t<ms>\tbuffer <ms> milliseconds on the server, overriding -l\n");
+	fprintf(stderr, "\t-m<ms>\trefill the server <ms> milliseconds at a time, overriding -l\n");
+	fprintf(stderr, "\t-u<hz>\tupdate the status line <hz> times a second, 0 to not (default: 4)\n");
+}
 
 int main(int argc, char **argv) {
-	track_i **all_tracks = NULL;
-	int total_tracks = 0;
-	for (int i = 1; i < argc; i++) {
-		track_i **tracks = NULL;
-		int n = tracks_from_file(&tracks, argv[i]);
-		if (n <= 0) continue;
-		all_tracks = realloc(all_tracks,
-			(total_tracks+n) * sizeof *all_tracks);
-		memcpy(&all_tracks[total_tracks], tracks,
-			n * sizeof *tracks);
-		free(tracks);
-		total_tracks += n;
-	}
-	if (total_tracks == 0) return 0;
+	long buffer_ms = 500;
+	int probe_workers = 4;
+	double status_hz = 4;
+	int opt;
+	while ((opt = getopt(argc, argv, "hnsa:b:j:l:m:p:q:r:t:u:")) != -1) {
+		switch (opt) {
+		case 'b':
+			buffer_ms = strtol(optarg, NULL, 0);
+			if (buffer_ms <= 0) {
+				fprintf(stderr, "invalid buffer length: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'a': {
+			long kib = strtol(optarg, NULL, 0);
+			if (kib < 0) {
+				fprintf(stderr, "invalid read-ahead: %s\n", optarg);
+				return 1;
+			}
+			readahead_bytes = kib << 10;
+			break;
+		}
+		case 'n': native_rate = true; break;
+		case 's': server_volume = true; break;
+		case 'j':
+			probe_workers = strtol(optarg, NULL, 0);
+			if (probe_workers < 1) {
+				fprintf(stderr, "invalid probe threads: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			decoder_pool = strtol(optarg, NULL, 0);
+			if (decoder_pool < 2) {
+				fprintf(stderr, "invalid decoder pool: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'q': {
+			int quality = resample_quality_from_name(optarg);
+			if (quality < 0) {
+				fprintf(stderr, "invalid quality: %s\n", optarg);
+				return 1;
+			}
+			resample_quality = quality;
+			break;
+		}
+		case 'r': {
+			int backend = resample_backend_from_name(optarg);
+			if (backend < 0) {
+				fprintf(stderr, "invalid resampler: %s\n", optarg);
+				return 1;
+			}
+			resample_backend = backend;
+			break;
+		}
+		case 'l': {
+			int profile = latency_profile_from_name(optarg);
+			if (profile < 0) {
+				fprintf(stderr, "invalid latency profile: %s\n", optarg);
+				return 1;
+			}
+			latency_profile = profile;
+			break;
+		}
+		case 't':
+			latency_target_ms = strtol(optarg, NULL, 0);
+			if (latency_target_ms <= 0) {
+				fprintf(stderr, "invalid latency: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			latency_request_ms = strtol(optarg, NULL, 0);
+			if (latency_request_ms <= 0) {
+				fprintf(stderr, "invalid request size: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'u': {
+			char *end;
+			status_hz = strtod(optarg, &end);
+			if (end == optarg || status_hz < 0) {
+				fprintf(stderr, "invalid status rate: %s\n", optarg);
+				return 1;
+			}
+			break;
+		}
+		case 'h': print_help(argv[0]); return 0;
+		default:  print_help(argv[0]); return 1;
+		}
+	}
 
 	struct player *player = calloc(1, sizeof *player);
 	mtx_init(&player->lock, mtx_plain);
 	struct playlist *pl = &player->pl;
-	pl->track = all_tracks;
-	pl->size  = total_tracks;
+	mtx_init(&pl->lock, mtx_plain);
+	pl->open = calloc(decoder_pool+2, sizeof *pl->open);
+	mtx_init(&player->now_lock, mtx_plain);
+
+	// Playback starts with the first track;
+	// the rest of the playlist keeps coming in behind it.
+	cache_load();
+	probe *probe = probe_start(player,
+		&argv[optind], argc - optind, probe_workers);
+	if (!probe || probe_wait(probe) == 0) return 0;
+	player->buffer_ms = buffer_ms;
+	player->volume = 1;
 
 	pa_mainloop *loop = pa_mainloop_new();
 	pa_mainloop_api *api = pa_mainloop_get_api(loop);
+	player->loop = loop;
 
 	pa_context *ctx = pa_context_new(api, "poppy");
 	ctx_ud *ud = calloc(1, sizeof *ud);
@@ -216,24 +1136,44 @@ int main(int argc, char **argv) {
 	pa_context_set_state_callback(ctx, ctx_state_cb, ud);
 	assert(pa_context_connect(ctx, NULL, 0, NULL) >= 0);
 
-	thrd_t dbus;
-	int ret = thrd_create(&dbus, dbus_main, player);
-	if (ret != thrd_success) {
-		fprintf(stderr, "unable to start dbus thread\n");
-	} else {
-		thrd_detach(dbus);
+	if (dbus_attach(player, api) < 0) {
+		fprintf(stderr, "continuing without MPRIS\n");
+	}
+	if (ctl_attach(player, api) < 0) {
+		fprintf(stderr, "continuing without poppyctl\n");
+	}
+
+	// The status line is only for a terminal to look at.
+	status_ud status = {
+		.player = player,
+		.period = status_hz > 0 ? PA_USEC_PER_SEC / status_hz : 0,
+	};
+	pa_time_event *status_event = NULL;
+	if (status.period && isatty(STDOUT_FILENO)) {
+		struct timeval tv;
+		status_event = api->time_new(api,
+			pa_timeval_rtstore(&tv, pa_rtclock_now(), true),
+			status_cb, &status);
 	}
-	while (!player->conn);
 
 	int runret;
 	int curr_track = -1;
 	while (pa_mainloop_iterate(loop, 1, &runret) >= 0) {
-		track_i *track = pl->track[pl->curr];
-		track_state state = track->state(track);
-		track_meta meta = track->meta(track);
-		if (curr_track != pl->curr) {
-			curr_track = pl->curr;
-			signal_metadata_update(player->conn, player);
+		if (atomic_load(&player->failed)) {
+			runret = 1;
+			break;
+		}
+		player_acks(player);
+		if (atomic_exchange(&player->starved, false) && player->stream) {
+			size_t bytes = pa_stream_writable_size(player->stream);
+			if (bytes != (size_t) -1) play(player->stream, bytes, player);
+		}
+		now_playing now = player_snapshot(player);
+		if (!now.has_meta) continue;
+		const track_meta meta = now.meta;
+		if (curr_track != now.mark.track) {
+			curr_track = now.mark.track;
+			if (player->conn) signal_metadata_update(player->conn, player);
 			fputc('\n', stdout);
 			printf(" Audio: %dch %dbit @ %gkhz @ %gkbps\n",
 				meta.channels,
@@ -244,27 +1184,26 @@ int main(int argc, char **argv) {
 			if (meta.artist) printf("Artist: %s\n", meta.artist);
 			if (meta.album)  printf(" Album: %s\n", meta.album);
 			if (meta.title)  printf(" Title: %s\n", meta.title);
+			fflush(stdout);
+			status.shown[0] = '\0';
 		}
-		fputc('\r', stdout);
-		if (meta.tracknumber) {
-			printf("%s", meta.tracknumber);
-			if (meta.tracktotal) printf("/%s ", meta.tracktotal);
-			else printf(" ");
-		}
-		double now = state.time;
-		double remaining = meta.length - now;
-		double min, sec;
-		sec = modf(now/60, &min)*60;
-		printf("[%02.0f:%05.2f/", min, sec);
-		sec = modf(meta.length/60, &min)*60;
-		printf("%02.0f:%05.2f/", min, sec);
-		remaining = meta.length - now;
-		sec = modf(remaining/60, &min)*60;
-		printf("%02.0f:%05.2f]", min, sec);
-		fflush(stdout);
 	}
 	fputc('\n', stdout);
+	cache_save(player);
+	input_stats reads = input_get_stats();
+	fprintf(stderr, "read-ahead: %lu hits, %lu misses\n",
+		reads.hits, reads.misses);
+	latency_stats lat = latency_get_stats();
+	if (lat.underruns) {
+		fprintf(stderr, "underruns: %lu, first at %.1fs, last at %.1fs\n",
+			lat.underruns, lat.first, lat.last);
+	}
+	if (lat.grown_ms) {
+		fprintf(stderr, "server buffer grown to %ld ms\n", lat.grown_ms);
+	}
 
+	if (status_event) api->time_free(status_event);
+	ctl_detach(api);
 	pa_context_unref(ctx);
 	pa_mainloop_free(loop);
 	return runret;
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+#include "poppy.h"
+#include "track.h"
+#include "probe.h"
+#include "cache.h"
+
+typedef struct probe_result {
+	track_desc *descs;
+	int n;
+	bool done;
+} probe_result;
+
+struct probe {
+	struct player *player;
+	char **files;
+	int cnt;
+	atomic_int next;
+	probe_result *result;
+	// Files handed to the playlist so far.
+	int appended;
+	int running;
+	mtx_t lock;
+	cnd_t cond;
+};
+
+static int probe_main(void *_probe) {
+	probe *probe = _probe;
+	for (;;) {
+		int i = atomic_fetch_add(&probe->next, 1);
+		if (i >= probe->cnt) break;
+		probe_result result = { 0 };
+		result.n = cache_lookup(probe->files[i], &result.descs);
+		if (result.n < 0) {
+			result.n = track_descs_from_file(&result.descs, probe->files[i]);
+		}
+		result.done = true;
+		mtx_lock(&probe->lock);
+		probe->result[i] = result;
+		// Whoever finishes the next file in order hands over
+		// it and everything after it that is already done.
+		while (probe->appended < probe->cnt &&
+			probe->result[probe->appended].done) {
+			probe_result *ready = &probe->result[probe->appended++];
+			if (ready->n > 0) {
+				player_append(probe->player, ready->descs, ready->n);
+			}
+			free(ready->descs);
+			ready->descs = NULL;
+		}
+		cnd_broadcast(&probe->cond);
+		mtx_unlock(&probe->lock);
+	}
+	mtx_lock(&probe->lock);
+	bool last = --probe->running == 0;
+	if (last) atomic_store(&probe->player->probing, false);
+	cnd_broadcast(&probe->cond);
+	mtx_unlock(&probe->lock);
+	// Index the links found, so the next run can skip scanning.
+	if (last) cache_save(probe->player);
+	return 0;
+}
+
+probe *probe_start(struct player *player, char **files, int cnt, int workers) {
+	probe *probe = calloc(1, sizeof *probe);
+	if (!probe) return NULL;
+	probe->result = calloc(cnt ? cnt : 1, sizeof *probe->result);
+	if (!probe->result) {
+		free(probe);
+		return NULL;
+	}
+	probe->player = player;
+	probe->files  = files;
+	probe->cnt    = cnt;
+	atomic_init(&probe->next, 0);
+	mtx_init(&probe->lock, mtx_plain);
+	cnd_init(&probe->cond);
+	if (workers > cnt) workers = cnt;
+	atomic_store(&player->probing, cnt > 0);
+	mtx_lock(&probe->lock);
+	for (int w = 0; w < workers; w++) {
+		thrd_t worker;
+		if (thrd_create(&worker, probe_main, probe) != thrd_success) {
+			fprintf(stderr, "unable to start probe thread\n");
+			break;
+		}
+		thrd_detach(worker);
+		probe->running++;
+	}
+	mtx_unlock(&probe->lock);
+	// Without any workers, probe everything right here.
+	if (probe->running == 0 && cnt > 0) {
+		probe->running++;
+		probe_main(probe);
+	}
+	return probe;
+}
+
+int probe_wait(probe *probe) {
+	struct playlist *pl = &probe->player->pl;
+	mtx_lock(&probe->lock);
+	while (pl->size == 0 && probe->running > 0) {
+		cnd_wait(&probe->cond, &probe->lock);
+	}
+	int size = pl->size;
+	mtx_unlock(&probe->lock);
+	return size;
+}
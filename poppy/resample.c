@@ -0,0 +1,258 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <speex/speex_resampler.h>
+#ifdef HAVE_SWRESAMPLE
+#include <libswresample/swresample.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/opt.h>
+#endif
+
+#include "resample.h"
+#include "conv.h"
+
+enum resample_quality resample_quality = resample_default;
+enum resample_backend resample_backend = resample_speex;
+
+static const char *quality_names[] = {
+	[resample_fast]    = "fast",
+	[resample_default] = "default",
+	[resample_best]    = "best",
+};
+
+static const char *backend_names[] = {
+	[resample_speex] = "speex",
+	[resample_swr]   = "swr",
+};
+
+// Speex has always resampled at its highest quality,
+// so only fast trades any of it away.
+static const int speex_quality[] = {
+	[resample_fast]    = SPEEX_RESAMPLER_QUALITY_DESKTOP,
+	[resample_default] = SPEEX_RESAMPLER_QUALITY_MAX,
+	[resample_best]    = SPEEX_RESAMPLER_QUALITY_MAX,
+};
+
+static int from_name(const char **names, int len, const char *name) {
+	for (int i = 0; i < len; i++) {
+		if (!strcmp(names[i], name)) return i;
+	}
+	return -1;
+}
+
+int resample_quality_from_name(const char *name) {
+	int len = sizeof quality_names / sizeof *quality_names;
+	return from_name(quality_names, len, name);
+}
+
+int resample_backend_from_name(const char *name) {
+	int len = sizeof backend_names / sizeof *backend_names;
+	int backend = from_name(backend_names, len, name);
+#ifndef HAVE_SWRESAMPLE
+	if (backend == resample_swr) {
+		fprintf(stderr, "built without libswresample\n");
+		return -1;
+	}
+#endif
+	return backend;
+}
+
+#ifdef HAVE_SWRESAMPLE
+static struct SwrContext *swr_new(resampler *r) {
+	AVChannelLayout layout;
+	av_channel_layout_default(&layout, r->channels);
+	struct SwrContext *swr = NULL;
+	int ret = swr_alloc_set_opts2(&swr,
+		&layout, AV_SAMPLE_FMT_FLT, r->out_rate,
+		&layout, r->planar ? AV_SAMPLE_FMT_FLTP : AV_SAMPLE_FMT_FLT,
+		r->in_rate,
+		0, NULL
+	);
+	if (ret < 0) return NULL;
+	switch (resample_quality) {
+	case resample_fast:
+		av_opt_set_int(swr, "filter_size", 8, 0);
+		av_opt_set_int(swr, "linear_interp", 1, 0);
+		break;
+	case resample_best:
+		av_opt_set_int(swr, "filter_size", 64, 0);
+		av_opt_set_int(swr, "phase_shift", 14, 0);
+		break;
+	default: break;
+	}
+	if (swr_init(swr) < 0) {
+		swr_free(&swr);
+		return NULL;
+	}
+	return swr;
+}
+
+// swr keeps whatever does not fit in out, so only feed it as much
+// as out can take to keep that backlog small.
+static void swr_process(
+	resampler *r,
+	const uint8_t *const *in, int *in_len,
+	float *out, int *out_len
+) {
+	long fit = (long) *out_len * r->in_rate / r->out_rate;
+	// Upsampling into a few frames would otherwise feed it nothing.
+	if (fit < 1) fit = 1;
+	if (*in_len > fit) *in_len = fit;
+	uint8_t *outv[] = { (uint8_t*) out };
+	int ret = swr_convert(r->swr, outv, *out_len, in, *in_len);
+	*out_len = ret < 0 ? 0 : ret;
+}
+#endif
+
+resampler *resampler_new(int channels, int in_rate, int out_rate, bool planar) {
+	resampler *r = calloc(1, sizeof *r);
+	if (!r) return NULL;
+	*r = (resampler) {
+		.channels = channels,
+		.in_rate  = in_rate,
+		.out_rate = out_rate,
+		.planar   = planar,
+	};
+#ifdef HAVE_SWRESAMPLE
+	if (resample_backend == resample_swr) {
+		r->swr = swr_new(r);
+		if (r->swr) return r;
+		fprintf(stderr, "unable to init swresample, using speex\n");
+	}
+#endif
+	int err;
+	r->speex = speex_resampler_init(
+		channels, in_rate, out_rate,
+		speex_quality[resample_quality], &err
+	);
+	if (!r->speex) {
+		fprintf(stderr, "speex_resampler_init: %d\n", err);
+		free(r);
+		return NULL;
+	}
+	resampler_reset(r);
+	return r;
+}
+
+void resampler_free(resampler *r) {
+	if (!r) return;
+	if (r->speex) speex_resampler_destroy(r->speex);
+#ifdef HAVE_SWRESAMPLE
+	if (r->swr) swr_free(&r->swr);
+#endif
+	free(r->scratch);
+	free(r);
+}
+
+// Without its leading zeros, and flushed at the end with drain,
+// a resampled track lines up with its neighbours sample for sample.
+void resampler_reset(resampler *r) {
+	if (r->speex) {
+		speex_resampler_reset_mem(r->speex);
+		speex_resampler_skip_zeros(r->speex);
+		r->tail = speex_resampler_get_input_latency(r->speex);
+	}
+#ifdef HAVE_SWRESAMPLE
+	if (r->swr) swr_init(r->swr);
+#endif
+}
+
+void resampler_process(
+	resampler *r,
+	const float *in, int *in_len,
+	float *out, int *out_len
+) {
+#ifdef HAVE_SWRESAMPLE
+	if (r->swr) {
+		const uint8_t *inv[] = { (const uint8_t*) in };
+		swr_process(r, inv, in_len, out, out_len);
+		return;
+	}
+#endif
+	spx_uint32_t il = *in_len, ol = *out_len;
+	speex_resampler_process_interleaved_float(r->speex, in, &il, out, &ol);
+	*in_len = il;
+	*out_len = ol;
+}
+
+void resampler_process_planar(
+	resampler *r,
+	float *const *in, int offset, int *in_len,
+	float *out, int *out_len
+) {
+#ifdef HAVE_SWRESAMPLE
+	if (r->swr) {
+		const uint8_t *inv[8];
+		for (int ch = 0; ch < r->channels && ch < 8; ch++) {
+			inv[ch] = (const uint8_t*) &in[ch][offset];
+		}
+		swr_process(r, inv, in_len, out, out_len);
+		return;
+	}
+#endif
+	// Resample each channel into its own contiguous run,
+	// then interleave them all in one pass.
+	int chn = r->channels;
+	if (r->scratch_len < *out_len) {
+		float *scratch = realloc(r->scratch,
+			(size_t) chn * *out_len * sizeof *scratch);
+		if (!scratch) {
+			*in_len = *out_len = 0;
+			return;
+		}
+		r->scratch = scratch;
+		r->scratch_len = *out_len;
+	}
+	const float *runs[chn];
+	spx_uint32_t il = 0, ol = 0;
+	for (int ch = 0; ch < chn; ch++) {
+		float *run = &r->scratch[ch * r->scratch_len];
+		il = *in_len;
+		ol = *out_len;
+		speex_resampler_process_float(r->speex, ch,
+			&in[ch][offset], &il, run, &ol);
+		runs[ch] = run;
+	}
+	conv_f32_planar(out, runs, chn, ol);
+	*in_len = il;
+	*out_len = ol;
+}
+
+int resampler_drain(resampler *r, float *out, int out_len) {
+#ifdef HAVE_SWRESAMPLE
+	if (r->swr) {
+		int ret = swr_convert(r->swr, (uint8_t*[]) { (uint8_t*) out },
+			out_len, NULL, 0);
+		return ret < 0 ? 0 : ret;
+	}
+#endif
+	if (r->tail <= 0) return 0;
+	// A NULL input is read as silence.
+	spx_uint32_t il = r->tail, ol = out_len;
+	speex_resampler_process_interleaved_float(r->speex, NULL, &il, out, &ol);
+	r->tail -= il;
+	if (ol == 0) r->tail = 0;
+	return ol;
+}
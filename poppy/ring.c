@@ -0,0 +1,233 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+
+Copyright 2021 Russell Hernandez Ruiz <qrpnxz@hyperlife.xyz>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+#include "ring.h"
+
+int pcm_ring_init(pcm_ring *ring, size_t samples, size_t marks) {
+	*ring = (pcm_ring) { 0 };
+	ring->pcm = calloc(samples, sizeof *ring->pcm);
+	ring->mark = calloc(marks, sizeof *ring->mark);
+	if (!ring->pcm || !ring->mark) {
+		free(ring->pcm);
+		free(ring->mark);
+		return -1;
+	}
+	atomic_init(&ring->size, samples);
+	atomic_init(&ring->mark_size, marks);
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->mark_head, 0);
+	atomic_init(&ring->mark_tail, 0);
+	atomic_init(&ring->waiting, false);
+	mtx_init(&ring->lock, mtx_plain);
+	cnd_init(&ring->cond);
+	return 0;
+}
+
+void pcm_ring_free(pcm_ring *ring) {
+	free(ring->pcm);
+	free(ring->mark);
+	mtx_destroy(&ring->lock);
+	cnd_destroy(&ring->cond);
+}
+
+// Moves what is in [tail, head) to where it falls in a bigger buffer.
+static void *regrow(void *old, size_t old_size, size_t new_size,
+	size_t elem, size_t tail, size_t head) {
+	unsigned char *new = calloc(new_size, elem);
+	if (!new) return NULL;
+	for (size_t i = tail; i < head;) {
+		size_t from = i % old_size, to = i % new_size;
+		size_t n = head - i;
+		if (n > old_size - from) n = old_size - from;
+		if (n > new_size - to) n = new_size - to;
+		memcpy(&new[to*elem], (unsigned char*) old + from*elem, n*elem);
+		i += n;
+	}
+	return new;
+}
+
+int pcm_ring_grow(pcm_ring *ring, size_t samples, size_t marks) {
+	float *pcm = NULL;
+	pcm_mark *mark = NULL;
+	mtx_lock(&ring->lock);
+	if (samples > ring->size) {
+		pcm = regrow(ring->pcm, ring->size, samples, sizeof *pcm,
+			atomic_load(&ring->tail), atomic_load(&ring->head));
+	}
+	if (marks > ring->mark_size) {
+		mark = regrow(ring->mark, ring->mark_size, marks, sizeof *mark,
+			atomic_load(&ring->mark_tail), atomic_load(&ring->mark_head));
+	}
+	bool ok = (pcm || samples <= ring->size) &&
+		(mark || marks <= ring->mark_size);
+	if (ok && pcm) {
+		free(ring->pcm);
+		ring->pcm = pcm;
+		atomic_store(&ring->size, samples);
+	}
+	if (ok && mark) {
+		free(ring->mark);
+		ring->mark = mark;
+		atomic_store(&ring->mark_size, marks);
+	}
+	if (!ok) {
+		free(pcm);
+		free(mark);
+	}
+	// A waiting producer may have room now.
+	cnd_signal(&ring->cond);
+	mtx_unlock(&ring->lock);
+	return ok ? 0 : -1;
+}
+
+size_t pcm_ring_fill(pcm_ring *ring) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	return head - tail;
+}
+
+size_t pcm_ring_space(pcm_ring *ring) {
+	return ring->size - pcm_ring_fill(ring);
+}
+
+static size_t pcm_ring_mark_space(pcm_ring *ring) {
+	size_t head = atomic_load_explicit(&ring->mark_head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->mark_tail, memory_order_acquire);
+	return ring->mark_size - (head - tail);
+}
+
+float *pcm_ring_write_ptr(pcm_ring *ring, size_t *samples) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t pos = head % ring->size;
+	size_t space = ring->size - (head - tail);
+	size_t contiguous = ring->size - pos;
+	*samples = space < contiguous ? space : contiguous;
+	return &ring->pcm[pos];
+}
+
+void pcm_ring_commit(pcm_ring *ring, size_t samples) {
+	atomic_fetch_add_explicit(&ring->head, samples, memory_order_release);
+}
+
+bool pcm_ring_push_mark(pcm_ring *ring, const pcm_mark *mark) {
+	if (pcm_ring_mark_space(ring) == 0) return false;
+	size_t head = atomic_load_explicit(&ring->mark_head, memory_order_relaxed);
+	ring->mark[head % ring->mark_size] = *mark;
+	atomic_store_explicit(&ring->mark_head, head+1, memory_order_release);
+	return true;
+}
+
+// Leaves ring->pcm alone, which may be replaced meanwhile.
+static bool pcm_ring_ready(pcm_ring *ring, size_t samples) {
+	size_t size = ring->size;
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t until_wrap = size - head % size;
+	if (samples > until_wrap) samples = until_wrap;
+	size_t space = size - (head - tail);
+	size_t contiguous = space < until_wrap ? space : until_wrap;
+	return contiguous >= samples &&
+		pcm_ring_mark_space(ring) >= PCM_MARKS_PER_CHUNK;
+}
+
+void pcm_ring_wait(pcm_ring *ring, size_t samples) {
+	if (pcm_ring_ready(ring, samples)) return;
+	mtx_lock(&ring->lock);
+	atomic_store(&ring->waiting, true);
+	while (!pcm_ring_ready(ring, samples) && !ring->woken) {
+		cnd_wait(&ring->cond, &ring->lock);
+	}
+	ring->woken = false;
+	atomic_store(&ring->waiting, false);
+	mtx_unlock(&ring->lock);
+}
+
+const float *pcm_ring_read_ptr(pcm_ring *ring, size_t *samples) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t pos = tail % ring->size;
+	size_t fill = head - tail;
+	size_t contiguous = ring->size - pos;
+	*samples = fill < contiguous ? fill : contiguous;
+	return &ring->pcm[pos];
+}
+
+void pcm_ring_consume(pcm_ring *ring, size_t samples) {
+	atomic_fetch_add_explicit(&ring->tail, samples, memory_order_release);
+	if (atomic_load(&ring->waiting)) {
+		mtx_lock(&ring->lock);
+		cnd_signal(&ring->cond);
+		mtx_unlock(&ring->lock);
+	}
+}
+
+bool pcm_ring_peek_mark(pcm_ring *ring, pcm_mark *mark) {
+	size_t head = atomic_load_explicit(&ring->mark_head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&ring->mark_tail, memory_order_relaxed);
+	if (head == tail) return false;
+	*mark = ring->mark[tail % ring->mark_size];
+	return true;
+}
+
+void pcm_ring_pop_mark(pcm_ring *ring) {
+	atomic_fetch_add_explicit(&ring->mark_tail, 1, memory_order_release);
+}
+
+// Waits for pcm_ring_wake, however much space is free,
+// but for no longer than ms, unless that is negative.
+void pcm_ring_idle(pcm_ring *ring, long ms) {
+	if (ms < 0) {
+		mtx_lock(&ring->lock);
+		while (!ring->woken) cnd_wait(&ring->cond, &ring->lock);
+		ring->woken = false;
+		mtx_unlock(&ring->lock);
+		return;
+	}
+	struct timespec until;
+	timespec_get(&until, TIME_UTC);
+	until.tv_sec  += ms / 1000;
+	until.tv_nsec += ms % 1000 * 1000000;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	mtx_lock(&ring->lock);
+	while (!ring->woken &&
+		cnd_timedwait(&ring->cond, &ring->lock, &until) == thrd_success);
+	ring->woken = false;
+	mtx_unlock(&ring->lock);
+}
+
+// Makes a waiting producer return early so it can notice
+// changes that are not about free space (e.g. a seek).
+// If it is not waiting yet, its next wait returns straight away.
+void pcm_ring_wake(pcm_ring *ring) {
+	mtx_lock(&ring->lock);
+	ring->woken = true;
+	cnd_signal(&ring->cond);
+	mtx_unlock(&ring->lock);
+}
@@ -17,173 +17,73 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <threads.h>
 #include <string.h>
-
-#include <ogg/ogg.h>
+#include <math.h>
 
 #include "track.h"
+#include "ogg_scan.h"
 #include "opus_track.h"
 #include "flac_track.h"
 #include "vorbis_track.h"
 
-int ogg_tracks_from_file(track_i ***tracks, const char *filename) {
-	FILE *file = fopen(filename, "r");
-	if (!file) {
-		fprintf(stderr, "fopen: %s: ", filename);
-		perror("");
-		return -1;
-	}
-	track_i **ogg_tracks = NULL;
-	int num_tracks = 0;
-	int link = 0;
-	long link_start = 0;
-	ogg_sync_state oy;
-	ogg_sync_init(&oy);
-	ogg_page og;
-	while (ogg_sync_pageout(&oy, &og) != 1) {
-		char *buf = ogg_sync_buffer(&oy, 0x1000);
-		int n = fread(buf, 1, 0x1000, file);
-		if (ferror(file)) {
-			fprintf(stderr, "error parsing ogg stream: %s\n",
-				filename);
-			if (ogg_tracks) free(ogg_tracks);
-			return -1;
-		}
-		ogg_sync_wrote(&oy, n);
-	}
-	ogg_stream_state os;
-link:
-	ogg_stream_init(&os, ogg_page_serialno(&og));
-	if (ogg_stream_pagein(&os, &og)) {
-		fprintf(stderr, "error parsing ogg stream: %s\n",
-			filename);
-		if (ogg_tracks) free(ogg_tracks);
-		return -1;
-	}
-	ogg_packet op;
-	if (ogg_stream_packetout(&os, &op) != 1) {
-		fprintf(stderr, "error parsing ogg stream: %s\n",
-			filename);
-		if (ogg_tracks) free(ogg_tracks);
-		return -1;
-	}
-
-	const char magic_opus[] = "OpusHead\x01";
-	const char magic_vorbis[] = "\x01vorbis\0\0\0\0";
-	const char magic_flac[] = "\177FLAC\x01\0";
-	enum codec {unknown, opus, vorbis, flac} codec;
-	if (!memcmp(op.packet, magic_opus, sizeof magic_opus - 1)) {
-		//fprintf(stderr, "DEBUG: detected OPUS\n");
-		codec = opus;
-	}
-	else if (!memcmp(op.packet, magic_vorbis, sizeof magic_vorbis - 1)) {
-		//fprintf(stderr, "DEBUG: detected VORBIS\n");
-		codec = vorbis;
-	}
-	else if (!memcmp(op.packet, magic_flac, sizeof magic_flac - 1)) {
-		//fprintf(stderr, "DEBUG: detected FLAC\n");
-		codec = flac;
-	}
-	else {
-		codec = unknown;
-	}
+void track_state_scale(track_state *state, float album, float track) {
+	float gain = state->gain;
+	switch (state->gain_type) {
+	case album_gain: gain += album; break;
+	case track_gain: gain += track; break;
+	default: break;
+	}
+	state->scale = gain == 0 ? 1 : powf(10, gain/20);
+}
 
-	bool last_link = false;
-	do {
-		while (ogg_sync_pageout(&oy, &og) != 1) {
-			char *buf = ogg_sync_buffer(&oy, 0x1000);
-			int n = fread(buf, 1, 0x1000, file);
-			if (feof(file)) {
-				last_link = true;
-				goto fin;
-			}
-			if (ferror(file)) {
-				fprintf(stderr, "unable to read file: %s\n",
-					filename);
-				if (ogg_tracks) free(ogg_tracks);
-				return -1;
-			}
-			ogg_sync_wrote(&oy, n);
-		}
-	} while (ogg_page_bos(&og));
-	do {
-		while (ogg_sync_pageout(&oy, &og) != 1) {
-			char *buf = ogg_sync_buffer(&oy, 0x1000);
-			int n = fread(buf, 1, 0x1000, file);
-			if (feof(file)) {
-				last_link = true;
-				goto fin;
-			}
-			if (ferror(file)) {
-				fprintf(stderr, "unable to read file: %s\n",
-					filename);
-				if (ogg_tracks) free(ogg_tracks);
-				return -1;
-			}
-			ogg_sync_wrote(&oy, n);
-		}
-	} while (!ogg_page_bos(&og));
-	long link_end;
-fin:
-	link_end = -1;
-	if (!last_link) {
-		long page_size = og.header_len + og.body_len;
-		long buffered  = oy.fill - oy.returned;
-		link_end = ftell(file) - (page_size + buffered);
-	}
-	switch (codec) {
-	case opus: {
-		opus_track *track = calloc(1, sizeof *track);
-		int ret = opus_track_from_file(track, filename, link_start, link_end);
-		if (ret == 0) {
-			ogg_tracks = realloc(ogg_tracks,
-				(num_tracks+1) * sizeof *ogg_tracks);
-			ogg_tracks[num_tracks++] = (track_i*) track;
-		}
-		break;
-	}
-	case vorbis: {
-		vorbis_track *track = calloc(1, sizeof *track);
-		int ret = vorbis_track_from_file(track, filename, link_start, link_end);
-		if (ret == 0) {
-			ogg_tracks = realloc(ogg_tracks,
-				(num_tracks+1) * sizeof *ogg_tracks);
-			ogg_tracks[num_tracks++] = (track_i*) track;
-		}
-		break;
+int ogg_descs_from_file(track_desc **descs, const char *filename) {
+	ogg_link *links;
+	int num_links = ogg_scan_links(filename, &links);
+	if (num_links < 0) return -1;
+	track_desc *ogg_descs = calloc(num_links, sizeof *ogg_descs);
+	int num_descs = 0;
+	const char *name = strdup(filename);
+	if (!ogg_descs || !name) {
+		fprintf(stderr, "unable to allocate tracks: %s\n", filename);
+		free(ogg_descs);
+		free((char*) name);
+		free(links);
+		return -1;
 	}
-	case flac: {
-		flac_track *track = calloc(1, sizeof *track);
-		int ret = flac_track_from_file(track, filename, true, link_start, link_end);
-		if (ret == 0) {
-			ogg_tracks = realloc(ogg_tracks,
-				(num_tracks+1) * sizeof *ogg_tracks);
-			ogg_tracks[num_tracks++] = (track_i*) track;
+	for (int link = 0; link < num_links; link++) {
+		if (!links[link].known) {
+			fprintf(stderr, "unknown codec in link: %d: %s\n",
+				link, filename);
+			continue;
 		}
-		break;
-	}
-	default:
-		fprintf(stderr, "unknown codec in link: %d: %s\n",
-			link, filename);
-		break;
-	}
-	if (last_link) {
-		ogg_stream_clear(&os);
-		ogg_sync_clear(&oy);
-		fclose(file);
-		*tracks = ogg_tracks;
-		return num_tracks;
-	}
-	link++;
-	goto link;
+		ogg_descs[num_descs++] = (track_desc) {
+			.filename   = name,
+			.codec      = links[link].codec,
+			.isogg      = true,
+			.link_start = links[link].start,
+			// An unchained file is opened whole.
+			.link_end   = num_links > 1 ? links[link].end : -1,
+		};
+	}
+	free(links);
+	// No link is playable, so nothing holds on to the name.
+	if (num_descs == 0) {
+		free(ogg_descs);
+		free((char*) name);
+		ogg_descs = NULL;
+	}
+	*descs = ogg_descs;
+	return num_descs;
 }
 
-int tracks_from_file(
-	track_i ***tracks,
+int track_descs_from_file(
+	track_desc **descs,
 	const char *filename
 ) {
 	char head[4];
@@ -210,18 +110,74 @@ int tracks_from_file(
 	if (!memcmp(head, "fLaC", 4)) {
 		//fprintf(stderr, "DEBUG: detected FLAC\n");
 		fclose(soundfile);
-		flac_track *track = calloc(1, sizeof *track);
-		int ret = flac_track_from_file(track, filename, false, 0, 0);
-		if (ret < 0) return ret;
-		*tracks = calloc(1, sizeof **tracks);
-		**tracks = (track_i*) track;
+		*descs = calloc(1, sizeof **descs);
+		**descs = (track_desc) {
+			.filename = strdup(filename),
+			.codec    = FLAC,
+			.link_end = -1,
+		};
 		return 1;
 	} else if (!memcmp(head, "OggS", 4)) {
 		//fprintf(stderr, "DEBUG: detected OGG\n");
 		fclose(soundfile);
-		return ogg_tracks_from_file(tracks, filename);
+		return ogg_descs_from_file(descs, filename);
 	} else {
 		fprintf(stderr, "unsupported file: %s\n", filename);
 		return -1;
 	}
 }
+
+static const char *dup_tag(const char *tag) {
+	return tag ? strdup(tag) : NULL;
+}
+
+track_i *track_open(const track_desc *desc) {
+	track_i *track = NULL;
+	int ret = -1;
+	switch (desc->codec) {
+	case OPUS: {
+		opus_track *t = calloc(1, sizeof *t);
+		if (t) ret = opus_track_from_file(t, desc->filename,
+			desc->link_start, desc->link_end);
+		track = (track_i*) t;
+		break;
+	}
+	case VORBIS: {
+		vorbis_track *t = calloc(1, sizeof *t);
+		if (t) ret = vorbis_track_from_file(t, desc->filename,
+			desc->link_start, desc->link_end);
+		track = (track_i*) t;
+		break;
+	}
+	case FLAC: {
+		flac_track *t = calloc(1, sizeof *t);
+		if (t) ret = flac_track_from_file(t, desc->filename,
+			desc->isogg, desc->link_start, desc->link_end);
+		track = (track_i*) t;
+		break;
+	}
+	}
+	if (ret < 0) {
+		free(track);
+		return NULL;
+	}
+	return track;
+}
+
+void track_desc_meta(track_desc *desc, track_i *track) {
+	if (atomic_load(&desc->has_meta)) return;
+	// The descriptor outlives the decoder, so it keeps its own tags.
+	track_meta meta = track->meta(track);
+	meta.artist      = dup_tag(meta.artist);
+	meta.album       = dup_tag(meta.album);
+	meta.title       = dup_tag(meta.title);
+	meta.tracknumber = dup_tag(meta.tracknumber);
+	meta.tracktotal  = dup_tag(meta.tracktotal);
+	desc->meta = meta;
+	atomic_store_explicit(&desc->has_meta, true, memory_order_release);
+}
+
+void track_close(track_i *track) {
+	track->close(track);
+	free(track);
+}
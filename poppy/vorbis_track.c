@@ -18,8 +18,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include <stddef.h>
+#include <errno.h>
 #include <string.h>
-#include <math.h>
 #include <ctype.h>
 
 #include <vorbis/vorbisfile.h>
@@ -27,8 +27,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "track.h"
 #include "vorbis_track.h"
 #include "def.h"
-#include "ch_map.h"
 #include "poppy.h"
+#include "resample.h"
+#include "conv.h"
+#include "input.h"
 
 const char *strvorbiserror(int err) {
 	static const char *table[] = {
@@ -52,62 +54,24 @@ const char *strvorbiserror(int err) {
 }
 
 size_t vorbis_read_callback(void *ptr, size_t size, size_t nmemb, void *datasource) {
-	vorbis_stream *stream = datasource;
-	if (stream->index >= stream->length) {
-		return 0;
-	}
-	if (stream->index + size*nmemb > stream->length) {
-		nmemb = stream->length - stream->index;
-		nmemb /= size;
-	}
-	for (;;) {
-		int n = fread(ptr, size, nmemb, stream->file);
-		if (n > 0) {
-			stream->index += n;
-			return n;
-		}
-		if (feof(stream->file)) return 0;
-		if (ferror(stream->file)) return -1;
-	}
+	if (size == 0) return 0;
+	// vorbisfile tells errors from the end by errno.
+	errno = 0;
+	long n = input_read(datasource, ptr, size*nmemb);
+	return n < 0 ? 0 : n / size;
 }
 
 int vorbis_seek_callback(void *datasource, ogg_int64_t offset, int whence) {
-	vorbis_stream *stream = datasource;
-	long real_offset;
-	long from_zero;
-	switch (whence) {
-	case SEEK_SET:
-		real_offset = offset - stream->index;
-		stream->index = offset;
-		break;
-	case SEEK_CUR:
-		real_offset = offset;
-		stream->index += offset;
-		break;
-	case SEEK_END:
-		from_zero = stream->length + offset;
-		real_offset = from_zero - stream->index;
-		stream->index = from_zero;
-		break;
-	}
-	if (real_offset < -stream->length) {
-		real_offset = -stream->length;
-		stream->index = 0;
-	} else if (real_offset > stream->length) {
-		real_offset = stream->length - stream->index;
-		stream->index = stream->length;
-	}
-	return fseek(stream->file, real_offset, SEEK_CUR);
+	return input_seek(datasource, offset, whence);
 }
 
 int vorbis_close_callback(void *datasource) {
-	vorbis_stream *stream = datasource;
-	return fclose(stream->file);
+	input_close(datasource);
+	return 0;
 }
 
 long vorbis_tell_callback(void *datasource) {
-	vorbis_stream *stream = datasource;
-	return stream->index;
+	return input_tell(datasource);
 }
 
 ov_callbacks vorbis_file_callbacks = {
@@ -129,55 +93,58 @@ track_meta vorbis_track_meta(track_i *this) {
 
 int vorbis_track_dec(track_i *this, float *pcm, int samples) {
 	vorbis_track *track = (vorbis_track*) this;
-	float sample_ratio = (float) track->meta.sample_rate / stream_sample_rate;
-	if (track->frame.consumed == track->frame.samples) {
-		int ret;
-	retry:
-		ret = ov_read_float(&track->file, &track->frame.pcm, 1 + samples * sample_ratio, NULL);
-		if (ret < 0) {
-			fprintf(stderr, "ov_read_float: %s\n",
-				strvorbiserror(ret));
-			switch (ret) {
-			case OV_HOLE: case OV_EREAD: case OV_EBADPACKET:
-				goto retry;
-			case OV_EINVAL:
-				ret = ov_test_open(&track->file);
-				fprintf(stderr, "ov_test_open: %s\n",
+	float sample_ratio = (float) track->meta.sample_rate / track->meta.dec_rate;
+	int chn = track->meta.channels;
+	for (;;) {
+		if (track->frame.consumed == track->frame.samples) {
+			int ret;
+		retry:
+			ret = ov_read_float(&track->file, &track->frame.pcm, 1 + samples * sample_ratio, NULL);
+			if (ret < 0) {
+				fprintf(stderr, "ov_read_float: %s\n",
 					strvorbiserror(ret));
-			default:
-				return -1;
+				switch (ret) {
+				case OV_HOLE: case OV_EREAD: case OV_EBADPACKET:
+					goto retry;
+				case OV_EINVAL:
+					ret = ov_test_open(&track->file);
+					fprintf(stderr, "ov_test_open: %s\n",
+						strvorbiserror(ret));
+				default:
+					return -1;
+				}
 			}
+			if (ret == 0) {
+				if (!track->resampler) return 0;
+				return resampler_drain(track->resampler, pcm, samples);
+			}
+			track->frame.samples = ret;
+			track->frame.consumed = 0;
 		}
-		if (ret == 0) return 0;
-		track->frame.samples = ret;
-		track->frame.consumed = 0;
-	}
-	int chn = track->meta.channels;
-	int consumed = track->frame.consumed;
-	int available = track->frame.samples - consumed;
-	spx_uint32_t in_len, out_len;
-	for (int ch = 0; ch < chn; ch++) {
-		in_len  = available;
-		out_len = samples;
-		speex_resampler_process_float(
-			track->resampler, ch,
-			&track->frame.pcm[ch][consumed], &in_len,
-			&pcm[vorbis_vorbis81_ch_map[chn][ch]], &out_len
-		);
-	}
-	float scale = powf(10, track->state.gain/20);
-	switch (track->state.gain_type) {
-	case album_gain: scale *= powf(10, track->album_gain/20); break;
-	case track_gain: scale *= powf(10, track->track_gain/20); break;
-	default: break;
-	}
-	int total_out_samples = stream_channel_cnt*out_len;
-	for (int s = 0; s < total_out_samples; s++) {
-		pcm[s] *= scale;
+		int consumed = track->frame.consumed;
+		int available = track->frame.samples - consumed;
+		int in_len, out_len;
+		if (!track->resampler) {
+			in_len = out_len = available < samples ? available : samples;
+			const float *in[chn];
+			for (int ch = 0; ch < chn; ch++) {
+				in[ch] = &track->frame.pcm[ch][consumed];
+			}
+			conv_f32_planar(pcm, in, chn, out_len);
+		}
+		else {
+			in_len  = available;
+			out_len = samples;
+			resampler_process_planar(track->resampler,
+				track->frame.pcm, consumed, &in_len,
+				pcm, &out_len);
+		}
+		track->state.time = ov_time_tell(&track->file);
+		track->frame.consumed += in_len;
+		// The resampler may take the last frames of a packet without
+		// giving anything back yet, but 0 is only for the end.
+		if (out_len > 0 || in_len == 0) return out_len;
 	}
-	track->state.time = ov_time_tell(&track->file);
-	track->frame.consumed += in_len;
-	return out_len;
 }
 
 int vorbis_track_seek(track_i *this, float offset, int whence) {
@@ -204,21 +171,28 @@ int vorbis_track_seek(track_i *this, float offset, int whence) {
 		track->state.time = track->meta.length;
 		real_offset = track->meta.length;
 	}
+	if (track->resampler) resampler_reset(track->resampler);
 	return ov_time_seek(&track->file, real_offset);
 }
 
+static void update_scale(vorbis_track *track) {
+	track_state_scale(&track->state, track->album_gain, track->track_gain);
+}
+
 int vorbis_track_gain(track_i *this, float gain, int whence) {
 	vorbis_track *track = (vorbis_track*) this;
 	switch (whence) {
 	case SEEK_SET: track->state.gain = gain; break;
 	case SEEK_CUR: track->state.gain += gain; break;
 	}
+	update_scale(track);
 	return 0;
 }
 
 int vorbis_track_gain_type(track_i *this, enum gain_type gain_type) {
 	vorbis_track *track = (vorbis_track*) this;
 	track->state.gain_type = gain_type;
+	update_scale(track);
 	return 0;
 }
 
@@ -234,6 +208,7 @@ int vorbis_track_close(track_i *this) {
 	free_if_null(track->meta.tracknumber);
 	free_if_null(track->meta.tracktotal);
 	ov_clear(&track->file);
+	resampler_free(track->resampler);
 	return 0;
 }
 
@@ -289,40 +264,21 @@ int vorbis_track_from_file(
 	*track = (vorbis_track) { 0 };
 	track->track_i = vorbis_track_vtable;
 
-	if (link_start == 0 && link_end == -1) {
-		int overr = ov_fopen(filename, &track->file);
-		if (overr != 0) {
-			fprintf(stderr,
-				"ov_fopen: %s: %s\n",
-				filename, strvorbiserror(overr));
-			return -1;
-		}
+	if (input_open(&track->stream, filename, link_start, link_end) < 0) {
+		return -1;
 	}
-	else {
-		FILE *file = fopen(filename, "r");
-		if (!file) {
-			fprintf(stderr, "fopen: %s: ", filename);
-			perror("");
-			return -1;
-		}
-		fseek(file, link_start, SEEK_CUR);
-		track->stream = (vorbis_stream) {
-			.file   = file,
-			.index  = 0,
-			.length = link_end,
-		};
-		int overr = ov_open_callbacks(
-			&track->stream,
-			&track->file,
-			NULL, 0,
-			vorbis_file_callbacks
-		);
-		if (overr != 0) {
-			fprintf(stderr,
-				"ov_open_callbacks: %s: %s\n",
-				filename, strvorbiserror(overr));
-			return -1;
-		}
+	int overr = ov_open_callbacks(
+		&track->stream,
+		&track->file,
+		NULL, 0,
+		vorbis_file_callbacks
+	);
+	if (overr != 0) {
+		fprintf(stderr,
+			"ov_open_callbacks: %s: %s\n",
+			filename, strvorbiserror(overr));
+		input_close(&track->stream);
+		return -1;
 	}
 
 	track->meta.codec = VORBIS;
@@ -341,15 +297,21 @@ int vorbis_track_from_file(
 	copy_tag(&track->meta.title, tags, "title");
 	copy_tag(&track->meta.tracknumber, tags, "tracknumber");
 	copy_tag(&track->meta.tracktotal, tags, "tracktotal");
-	
-	int speex_err;
-	track->resampler = speex_resampler_init(
-		stream_channel_cnt,
-		track->meta.sample_rate, stream_sample_rate,
-		10, &speex_err
+
+	update_scale(track);
+	track->meta.dec_rate = output_rate(track->meta.sample_rate);
+	if (track->meta.dec_rate == track->meta.sample_rate) return 0;
+
+	track->resampler = resampler_new(
+		track->meta.channels,
+		track->meta.sample_rate, track->meta.dec_rate,
+		true
 	);
-	speex_resampler_set_input_stride(track->resampler, 1);
-	speex_resampler_set_output_stride(track->resampler, stream_channel_cnt);
+	if (!track->resampler) {
+		// ov_clear closes the input through the close callback.
+		vorbis_track_close((track_i*) track);
+		return -1;
+	}
 
 	return 0;
 }
@@ -20,6 +20,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
 
 #include <unistd.h>
 #include <pwd.h>
@@ -27,10 +28,12 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <sys/types.h>
 #include <errno.h>
 
+#include "xdg.h"
+
 void xdg_state_home(char *path) {
 	const char *xdgstatehome = getenv("XDG_STATE_HOME");
 	if (xdgstatehome) {
-		sprintf(path, xdgstatehome);
+		sprintf(path, "%s", xdgstatehome);
 		return;
 	}
 	const char *home = getenv("HOME");
@@ -42,6 +45,31 @@ void xdg_state_home(char *path) {
 	return;
 }
 
+void xdg_cache_home(char *path) {
+	const char *xdgcachehome = getenv("XDG_CACHE_HOME");
+	if (xdgcachehome) {
+		sprintf(path, "%s", xdgcachehome);
+		return;
+	}
+	const char *home = getenv("HOME");
+	if (!home) {
+		struct passwd *passwd = getpwuid(getuid());
+		home = passwd->pw_dir;
+	}
+	sprintf(path, "%s/.cache", home);
+	return;
+}
+
+// Falls back to the state directory where there is no runtime one.
+void xdg_runtime_dir(char *path) {
+	const char *xdgruntimedir = getenv("XDG_RUNTIME_DIR");
+	if (xdgruntimedir) {
+		sprintf(path, "%s", xdgruntimedir);
+		return;
+	}
+	xdg_state_home(path);
+}
+
 int mkdirp(const char *path, mode_t mode) {
 	int r = mkdir(path, mode);
 	if (r && errno == ENOENT) {
@@ -54,7 +82,6 @@ int mkdirp(const char *path, mode_t mode) {
 			}
 			pathcopy[i] = '\0';
 			r = mkdir(pathcopy, mode | 0200);
-			perror(pathcopy);
 			if (r && errno != EEXIST) return r;
 			pathcopy[i] = '/';
 		}
@@ -63,24 +90,21 @@ int mkdirp(const char *path, mode_t mode) {
 	return r;
 }
 
-void write_pid_file(void) {
-	char path[4096] = {0};
-	xdg_state_home(path);
-	strcat(path, "/poppy");
-	int r = mkdirp(path, 0777);
-	if (r && errno != EEXIST) {
-		fprintf(stderr, "mkdir %s: ", path);
-		perror("");
-		exit(1);
+int ctl_socket_path(char *path, size_t size, bool create) {
+	char dir[4096] = {0};
+	xdg_runtime_dir(dir);
+	strcat(dir, "/poppy");
+	if (create) {
+		int r = mkdirp(dir, 0700);
+		if (r && errno != EEXIST) {
+			fprintf(stderr, "mkdir %s: ", dir);
+			perror("");
+			return -1;
+		}
 	}
-	strcat(path, "/pid");
-	FILE *f = fopen(path, "w");
-	if (!f) {
-		fprintf(stderr, "open %s: ", path);
-		perror("");
-		exit(1);
+	if ((size_t) snprintf(path, size, "%s/ctl", dir) >= size) {
+		fprintf(stderr, "%s/ctl: path too long\n", dir);
+		return -1;
 	}
-	pid_t pid = getpid();
-	fprintf(f, "%d\n", pid);
-	fclose(f);
+	return 0;
 }
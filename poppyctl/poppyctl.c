@@ -17,195 +17,141 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <string.h>
-#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <errno.h>
 
 #include <unistd.h>
-#include <pwd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-#include "def.h"
-
-#define SIGSEEK     (SIGRTMIN)
-#define SIGSKIP     (SIGRTMIN+1)
-#define SIGGAIN     (SIGRTMIN+2)
-#define SIGGAINTYPE (SIGRTMIN+3)
-#define SIGABSGAIN  (SIGRTMIN+4)
-#define SIGPLAYMODE (SIGRTMIN+5)
+#include "xdg.h"
 
 void print_help(const char *cmd) {
-	fprintf(stderr, "%s (stop|pause|play)\n", cmd);
-	fprintf(stderr, "%s seek [<seconds>]\n", cmd);
-	fprintf(stderr, "%s skip [<tracks>]\n", cmd);
-	fprintf(stderr, "%s gain [<dB>]\n", cmd);
-	fprintf(stderr, "%s gaintype [header|album|track|absolute]\n", cmd);
-	fprintf(stderr, "%s absgain [<dB>]\n", cmd);
-	fprintf(stderr, "%s playmode [playlist|repeat|repeatone|single]\n", cmd);
+	fprintf(stderr, "%s [<command>...]\n", cmd);
+	fprintf(stderr, "%s -\n\n", cmd);
+	fprintf(stderr, "Each argument is sent as one command, all at once;\n");
+	fprintf(stderr, "with - they are read from standard input, one per line.\n");
+	fprintf(stderr, "Without any, the player is paused or resumed.\n\n");
+	fprintf(stderr, "\tplay | pause | toggle | stop\n");
+	fprintf(stderr, "\tnext | prev\n");
+	fprintf(stderr, "\tseek <seconds>\t\tby seconds, may be negative\n");
+	fprintf(stderr, "\tpos <seconds>\t\tto seconds into the track\n");
+	fprintf(stderr, "\tstatus\t\t\tstate, track, position and length\n");
+	fprintf(stderr, "\tvolume [<linear>]\n");
+	fprintf(stderr, "\tgaintype [header|album|track|absolute]\n");
+	fprintf(stderr, "\tplaymode [playlist|repeat|repeatone|single]\n\n");
+	fprintf(stderr, "Replies are printed one per command, in order:\n");
+	fprintf(stderr, "\"ok\" and any result, or \"err\" and why.\n");
 }
 
-void xdg_state_home(char *path) {
-	const char *xdgstatehome = getenv("XDG_STATE_HOME");
-	if (xdgstatehome) {
-		sprintf(path, xdgstatehome);
-		return;
+// Copies replies to stdout, noting whether any was an error.
+static int relay(int fd, bool *line_start, bool *failed) {
+	char buf[4096];
+	ssize_t n = read(fd, buf, sizeof buf);
+	if (n < 0 && errno == EINTR) return 1;
+	if (n < 0) {
+		perror("read");
+		return -1;
 	}
-	const char *home = getenv("HOME");
-	if (!home) {
-		struct passwd *passwd = getpwuid(getuid());
-		home = passwd->pw_dir;
+	for (ssize_t i = 0; i < n; i++) {
+		if (*line_start && buf[i] == 'e') {
+			*failed = true;
+		}
+		*line_start = buf[i] == '\n';
 	}
-	sprintf(path, "%s/.local/state", home);
-	return;
+	fwrite(buf, 1, n, stdout);
+	return n > 0;
 }
 
 int main(int argc, char *argv[]) {
-	char path[4096] = {0};
-	xdg_state_home(path);
-	strcat(path, "/poppy/pid");
-	FILE *pidfile = fopen(path, "r");
-	if (!pidfile) {
-		fprintf(stderr, "open %s: ", path);
-		perror("");
-		return -1;
-	}
-	pid_t pid;
-	fscanf(pidfile, "%d", &pid);
-	if (argc-1 < 1) {
-		sprintf(path, "/proc/%d/stat", pid);
-		FILE *stat = fopen(path, "r");
-		if (!stat) {
-			fprintf(stderr, "open %s: ", path);
-			perror("");
-			return -1;
-		}
-		char state;
-		fscanf(stat, "%*d %*s %c", &state);
-		fclose(stat);
-		switch (state) {
-		case 'R': case 'S':
-			if (kill(pid, SIGSTOP) != 0) {
-				perror("kill");
-				return -1;
-			}
-			return 0;
-		case 'T':
-			if (kill(pid, SIGCONT) != 0) {
-				perror("kill");
-				return -1;
-			}
-			return 0;
-		default: return -1;
-		}
-	}
-	union sigval val;
-	if (!strcmp(argv[1], "stop")) {
-		if (kill(pid, SIGTERM) != 0) {
-			perror("kill");
-			return -1;
-		}
+	if (argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
+		print_help(argv[0]);
 		return 0;
 	}
-	if (!strcmp(argv[1], "pause")) {
-		if (kill(pid, SIGSTOP) != 0) {
-			perror("kill");
-			return -1;
-		}
-		return 0;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (ctl_socket_path(addr.sun_path, sizeof addr.sun_path, false) < 0) {
+		return 1;
 	}
-	if (!strcmp(argv[1], "play")) {
-		if (kill(pid, SIGCONT) != 0) {
-			perror("kill");
-			return -1;
-		}
-		return 0;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
 	}
-	if (!strcmp(argv[1], "seek")) {
-		if (argc-1 < 2) return 0;
-		double offset = strtof(argv[2], NULL);
-		val.sival_int = offset * 1e3;
-		if (sigqueue(pid, SIGSEEK, val) != 0) {
-			perror("sigqueue");
-			return -1;
-		}
-		return 0;
-	}
-	if (!strcmp(argv[1], "skip")) {
-		val.sival_int = 0;
-		if (argc-1 >= 2) {
-			val.sival_int = strtol(argv[2], NULL, 0);
-		}
-		if (sigqueue(pid, SIGSKIP, val) != 0) {
-			perror("sigqueue");
-			return -1;
-		}
-		return 0;
+	if (connect(fd, (struct sockaddr*) &addr, sizeof addr) < 0) {
+		fprintf(stderr, "connect %s: ", addr.sun_path);
+		perror("");
+		return 1;
 	}
-	if (!strcmp(argv[1], "gain")) {
-		if (argc-1 < 2) return 0;
-		float gain = strtof(argv[2], NULL);
-		val.sival_int = gain * 256;
-		if (sigqueue(pid, SIGGAIN, val) != 0) {
-			perror("sigqueue");
-			return -1;
+
+	// Commands are sent as poppy takes them and replies read as they
+	// come, so that neither side waits on the other with buffers full.
+	bool from_stdin = argc == 2 && !strcmp(argv[1], "-");
+	char *req;
+	size_t req_len = 0, req_off = 0;
+	if (from_stdin) {
+		req = malloc(4096);
+		if (!req) return 1;
+	} else {
+		// Sent in one go, so that the commands reach poppy together.
+		size_t len = sizeof "toggle\n";
+		for (int i = 1; i < argc; i++) len += strlen(argv[i]) + 1;
+		req = malloc(len);
+		if (!req) return 1;
+		for (int i = 1; i < argc; i++) {
+			req_len += sprintf(req + req_len, "%s\n", argv[i]);
 		}
-		return 0;
+		if (argc < 2) req_len = sprintf(req, "toggle\n");
 	}
-	if (!strcmp(argv[1], "gaintype")) {
-		val.sival_int =
-			  (argc-1 < 2)                   ? header_gain
-			: (!strcmp(argv[2], "header"))   ? header_gain
-			: (!strcmp(argv[2], "album"))    ? album_gain
-			: (!strcmp(argv[2], "track"))    ? track_gain
-			: (!strcmp(argv[2], "absolute")) ? absolute_gain
-			: (!strcmp(argv[2], "abs"))      ? absolute_gain
-			: -1;
-		if (val.sival_int < 0) {
-			fputs("header album track absolute\n", stderr);
-			return -1;
-		}
-		if (sigqueue(pid, SIGGAINTYPE, val) != 0) {
-			perror("sigqueue");
-			return -1;
+
+	// poppy hangs up once every command sent has been replied to.
+	bool line_start = true, failed = false;
+	bool in_open = from_stdin, shut = false;
+	for (;;) {
+		bool sending = req_off < req_len;
+		if (!sending && !in_open && !shut) {
+			shutdown(fd, SHUT_WR);
+			shut = true;
 		}
-		return 0;
-	}
-	if (!strcmp(argv[1], "absgain")) {
-		float gain = 0;
-		if (argc-1 >= 3) {
-			gain = strtof(argv[2], NULL);
+		struct pollfd fds[2] = {
+			{ .fd = fd, .events = POLLIN | (sending ? POLLOUT : 0) },
+			{ .fd = STDIN_FILENO, .events = POLLIN },
+		};
+		if (poll(fds, in_open && !sending ? 2 : 1, -1) < 0) {
+			if (errno == EINTR) continue;
+			perror("poll");
+			return 1;
 		}
-		val.sival_int = gain * 256;
-		if (sigqueue(pid, SIGABSGAIN, val) != 0) {
-			perror("sigqueue");
-			return -1;
+		if (fds[0].revents & POLLOUT) {
+			ssize_t n = send(fd, req + req_off, req_len - req_off,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (n < 0 && errno != EINTR && errno != EAGAIN) {
+				perror("send");
+				return 1;
+			}
+			if (n > 0) req_off += n;
 		}
-		return 0;
-	}
-	if (!strcmp(argv[1], "playmode")) {
-		val.sival_int =
-			  (argc-1 < 2)                    ? playlist
-			: (!strcmp(argv[2], "playlist"))  ? playlist
-			: (!strcmp(argv[2], "list"))      ? playlist
-			: (!strcmp(argv[2], "repeat"))    ? repeat
-			: (!strcmp(argv[2], "rep"))       ? repeat
-			: (!strcmp(argv[2], "repeatone")) ? repeat_one
-			: (!strcmp(argv[2], "repeat1"))   ? repeat_one
-			: (!strcmp(argv[2], "rep1"))      ? repeat_one
-			: (!strcmp(argv[2], "single"))    ? single
-			: -1;
-		if (val.sival_int < 0) {
-			fputs("playlist repeat repeatone single\n", stderr);
-			return -1;
+		if (in_open && !sending && fds[1].revents) {
+			ssize_t n = read(STDIN_FILENO, req, 4096);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) in_open = false;
+			req_len = n > 0 ? n : 0;
+			req_off = 0;
 		}
-		if (sigqueue(pid, SIGPLAYMODE, val) != 0) {
-			perror("sigqueue");
-			return -1;
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			int r = relay(fd, &line_start, &failed);
+			if (r < 0) return 1;
+			if (r == 0) break;
+			// Replies to a script should not sit in a pipe buffer.
+			if (from_stdin) fflush(stdout);
 		}
-		return 0;
 	}
-	print_help(argv[0]);
-	return -1;
+	free(req);
+	close(fd);
+	return failed;
 }